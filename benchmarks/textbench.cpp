@@ -0,0 +1,175 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+// Extracts the text of every page of the PDF files of a directory, the way
+// the generator does (Page::textLayout() then buildTextPage()), first on
+// one thread then on all of them, and prints the figures as JSON:
+//
+//   textbench <directory>
+
+#include "document.hpp"
+#include "page.hpp"
+#include "textpage.hpp"
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QThread>
+#include <QtCore/QtConcurrentMap>
+#include <okular/core/textpage.h>
+#include <cstdio>
+#include <sys/resource.h>
+
+using namespace QMuPDF;
+
+static QAtomicInt allocations;
+
+#ifdef __GLIBC__
+// count every allocation, including MuPDF's and Qt's, which do not go
+// through operator new
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+struct Result {
+    Result(): pages(0), chars(0), allocations(0), nsecs(0) { }
+    qint64 pages;
+    qint64 chars;
+    qint64 allocations;
+    qint64 nsecs;
+};
+
+static int extractPage(const Document *doc, int number)
+{
+    Page *page = doc->page(number);
+    if (!page)
+        return 0;
+    const QSizeF dpi(72, 72);
+    const TextLayout layout = page->textLayout(dpi);
+    const QSizeF size = page->size(dpi);
+    delete page;
+    delete buildTextPage(layout, size.width(), size.height());
+    return layout.count();
+}
+
+struct PageExtractor {
+    PageExtractor(const Document *d, QAtomicInt *c): doc(d), chars(c) { }
+    void operator()(int number) const
+        { chars->fetchAndAddRelaxed(extractPage(doc, number)); }
+    const Document *doc;
+    QAtomicInt *chars;
+};
+
+static void run(const QStringList &files, bool parallel, Result &result)
+{
+    foreach (const QString &file, files) {
+        Document doc;
+        // measure extraction, not the caches
+        doc.setTextCacheSize(0);
+        if (!doc.load(file) || doc.isLocked()) {
+            std::fprintf(stderr, "cannot open %s\n", qPrintable(file));
+            continue;
+        }
+        QList<int> numbers;
+        for (int i = 0; i < doc.pageCount(); ++i)
+            numbers.append(i);
+
+        QElapsedTimer timer;
+        const int allocated = allocations;
+        timer.start();
+        if (parallel) {
+            QAtomicInt chars;
+            QtConcurrent::blockingMap(numbers, PageExtractor(&doc, &chars));
+            result.chars += int(chars);
+        } else {
+            foreach (int number, numbers)
+                result.chars += extractPage(&doc, number);
+        }
+        result.nsecs += timer.nsecsElapsed();
+        result.allocations += int(allocations) - allocated;
+        result.pages += numbers.count();
+    }
+}
+
+static void report(const char *mode, int threads, const Result &result, bool last)
+{
+    const double seconds = result.nsecs / 1e9;
+    std::printf("    {\n"
+                "      \"mode\": \"%s\",\n"
+                "      \"threads\": %d,\n"
+                "      \"pages\": %lld,\n"
+                "      \"chars\": %lld,\n"
+                "      \"seconds\": %.3f,\n"
+                "      \"pages_per_second\": %.1f,\n"
+                "      \"chars_per_second\": %.0f,\n"
+                "      \"allocations_per_page\": %.1f\n"
+                "    }%s\n",
+                mode, threads, result.pages, result.chars, seconds,
+                seconds > 0 ? result.pages / seconds : 0.,
+                seconds > 0 ? result.chars / seconds : 0.,
+                result.pages > 0 ? double(result.allocations) / result.pages : 0.,
+                last ? "" : ",");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s <directory>\n", argv[0]);
+        return 1;
+    }
+    const QDir dir(QFile::decodeName(argv[1]));
+    QStringList files;
+    foreach (const QString &name, dir.entryList(QStringList() << "*.pdf" << "*.PDF",
+                                                QDir::Files, QDir::Name))
+        files.append(dir.filePath(name));
+    if (files.isEmpty()) {
+        std::fprintf(stderr, "no PDF file in %s\n", argv[1]);
+        return 1;
+    }
+
+    Result single, parallel;
+    run(files, false, single);
+    run(files, true, parallel);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::printf("{\n"
+                "  \"mupdf\": \"%s\",\n"
+                "  \"files\": %d,\n"
+                "  \"runs\": [\n", FZ_VERSION, files.count());
+    report("single", 1, single, false);
+    report("parallel", QThread::idealThreadCount(), parallel, true);
+    std::printf("  ],\n"
+                "  \"peak_rss_kb\": %ld\n"
+                "}\n", usage.ru_maxrss);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "context.hpp"
+#include <QtCore/QMutexLocker>
+
+namespace QMuPDF {
+
+Context::Context()
+{
+    // MuPDF keeps a pointer to the locks, so they live as long as we do
+    m_lockContext.user = this;
+    m_lockContext.lock = &Context::lock;
+    m_lockContext.unlock = &Context::unlock;
+    m_base = fz_new_context(NULL, &m_lockContext, FZ_STORE_DEFAULT);
+}
+
+Context::~Context()
+{
+    foreach (fz_context *ctx, m_pool)
+        fz_drop_context(ctx);
+    fz_drop_context(m_base);
+}
+
+fz_context *Context::acquire()
+{
+    QMutexLocker locker(&m_poolMutex);
+    if (!m_pool.isEmpty())
+        return m_pool.takeLast();
+    return fz_clone_context(m_base);
+}
+
+void Context::release(fz_context *ctx)
+{
+    QMutexLocker locker(&m_poolMutex);
+    m_pool.append(ctx);
+}
+
+void Context::lock(void *user, int lock)
+{
+    static_cast<Context*>(user)->m_locks[lock].lock();
+}
+
+void Context::unlock(void *user, int lock)
+{
+    static_cast<Context*>(user)->m_locks[lock].unlock();
+}
+
+}
@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_CONTEXT_HPP
+#define QMUPDF_CONTEXT_HPP
+
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+extern "C" {
+#include <mupdf/fitz.h>
+}
+
+namespace QMuPDF {
+
+// Owns the base fz_context (created with lock callbacks) and a pool of
+// clones of it. MuPDF requires every thread to use its own context; the
+// base one is only touched with the document mutex held.
+class Context {
+public:
+    Context();
+    ~Context();
+    fz_context *base() const { return m_base; }
+    fz_context *acquire();
+    void release(fz_context *ctx);
+private:
+    Q_DISABLE_COPY(Context)
+    static void lock(void *user, int lock);
+    static void unlock(void *user, int lock);
+    fz_locks_context m_lockContext;
+    QMutex m_locks[FZ_LOCK_MAX];
+    QMutex m_poolMutex;
+    QList<fz_context*> m_pool;
+    fz_context *m_base;
+};
+
+class ScopedContext {
+public:
+    ScopedContext(Context *context)
+        : m_context(context), m_ctx(context->acquire()) { }
+    ~ScopedContext() { m_context->release(m_ctx); }
+    operator fz_context*() const { return m_ctx; }
+private:
+    Q_DISABLE_COPY(ScopedContext)
+    Context *m_context;
+    fz_context *m_ctx;
+};
+
+}
+
+#endif
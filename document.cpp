@@ -7,10 +7,25 @@
  *   (at your option) any later version.                                   *
  ***************************************************************************/
 
-#include "document.hpp"
+#include "document_p.hpp"
 #include "page.hpp"
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
 #include <QtCore/QFile>
-#include <cstring>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QRegExp>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
+#ifdef Q_OS_UNIX
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 extern "C" {
 #include <mupdf/fitz.h>
 #include <mupdf/pdf.h>
@@ -20,59 +35,506 @@ namespace QMuPDF {
 
 QRectF convert_fz_rect(const fz_rect &rect, const QSizeF &dpi);
 
-struct Document::Data {
-    Data()
-        : ctx(fz_new_context(NULL, NULL, FZ_STORE_DEFAULT))
-        , mdoc(0), stream(0), pageCount(0), info(0)
-        , pageMode(Document::UseNone), locked(false) { }
-
-    fz_context *ctx;
-    fz_document *mdoc;
-    fz_stream *stream;
-    int pageCount;
-    pdf_obj *info;
-    PageMode pageMode;
-    bool locked;
-
-    pdf_document *pdf() const { return reinterpret_cast<pdf_document*>(mdoc); }
-    pdf_obj *dict(const char *key) const
-        { return pdf_dict_gets(ctx, pdf_trailer(ctx, pdf()), key); }
-    void loadInfoDict() { if (!info) info = dict("Info"); }
-    bool load()
-    {
-        pdf_obj *root = dict("Root");
-        if (!root)
-            return false;
+static const quint32 GeometryCacheMagic = 0x514d5047; // "QMPG"
+static const quint32 GeometryCacheVersion = 1;
+
+// Cache files are named after the document path; what they hold is only
+// trusted if it was written for the same file identity.
+QString Document::Data::cacheFile(const char *suffix) const
+{
+    if (cacheDir.isEmpty() || fileName.isEmpty())
+        return QString();
+    const QByteArray path = QFile::encodeName(QFileInfo(fileName).absoluteFilePath());
+    const QByteArray hash = QCryptographicHash::hash(path, QCryptographicHash::Sha1);
+    return cacheDir + QLatin1Char('/') + QString::fromLatin1(hash.toHex())
+        + QLatin1Char('.') + QLatin1String(suffix);
+}
+
+QByteArray Document::Data::fileIdentity() const
+{
+    QByteArray id;
+    pdf_obj *ids = dict("ID");
+    for (int i = 0; i < pdf_array_len(ctx, ids); ++i) {
+        pdf_obj *part = pdf_array_get(ctx, ids, i);
+        id += QByteArray(pdf_to_str_buf(ctx, part), pdf_to_str_len(ctx, part));
+    }
+
+    const QFileInfo info(fileName);
+    QByteArray identity;
+    QDataStream stream(&identity, QIODevice::WriteOnly);
+    stream << info.absoluteFilePath() << qint64(info.size())
+           << qint64(info.lastModified().toMSecsSinceEpoch()) << id;
+    return identity;
+}
+
+void Document::Data::readGeometryCache()
+{
+    QFile file(cacheFile("geometry"));
+    if (file.fileName().isEmpty() || !file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    quint32 magic, version;
+    QByteArray cachedIdentity;
+    qint32 count, mode;
+    stream >> magic >> version;
+    if (magic != GeometryCacheMagic || version != GeometryCacheVersion)
+        return;
+    stream >> cachedIdentity >> count >> mode;
+    if (cachedIdentity != identity || count != pageCount)
+        return;
+
+    QVector<PageGeometry> cached(count);
+    for (int i = 0; i < count; ++i) {
+        double width, height, duration;
+        stream >> width >> height >> duration;
+        cached[i].size = QSizeF(width, height);
+        cached[i].duration = duration;
+    }
+    if (stream.status() != QDataStream::Ok || mode < UseNone || mode > UseAttachments)
+        return;
+    geometry = cached;
+    pageMode = PageMode(mode);
+}
+
+void Document::Data::writeGeometryCache() const
+{
+    const QString path = cacheFile("geometry");
+    if (path.isEmpty())
+        return;
+    QDir().mkpath(cacheDir);
+
+    // write aside, so a concurrent reader never sees half a file
+    QFile file(path + QLatin1String(".new"));
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    QDataStream stream(&file);
+    stream << GeometryCacheMagic << GeometryCacheVersion << identity
+           << qint32(geometry.count()) << qint32(pageMode);
+    foreach (const PageGeometry &page, geometry) {
+        stream << double(page.size.width()) << double(page.size.height())
+               << double(page.duration);
+    }
+    file.close();
+    if (stream.status() != QDataStream::Ok) {
+        file.remove();
+        return;
+    }
+    QFile::remove(path);
+    file.rename(path);
+    trimCacheDirectory();
+}
+
+// Removes the least recently written files of the cache directory until
+// what is left fits in cacheDirSize.
+void Document::Data::trimCacheDirectory() const
+{
+    const qint64 maxSize = qint64(cacheDirSize) * 1024;
+    qint64 size = 0;
+    const QFileInfoList files = QDir(cacheDir).entryInfoList(QDir::Files, QDir::Time);
+    foreach (const QFileInfo &file, files) {
+        size += file.size();
+        if (size > maxSize)
+            QFile::remove(file.filePath());
+    }
+}
+
+// There is no way to ask MuPDF how big a display list is; the size of the
+// page contents it was recorded from is used as an estimate.
+int Document::Data::contentsSize(fz_context *ctx, int page) const
+{
+    pdf_obj *obj = pdf_lookup_page_obj(ctx, pdf(), page);
+    pdf_obj *contents = pdf_dict_gets(ctx, obj, "Contents");
+    if (!pdf_is_array(ctx, contents))
+        return pdf_to_int(ctx, pdf_dict_gets(ctx, contents, "Length"));
+    int size = 0;
+    const int count = pdf_array_len(ctx, contents);
+    for (int i = 0; i < count; ++i) {
+        pdf_obj *stream = pdf_array_get(ctx, contents, i);
+        size += pdf_to_int(ctx, pdf_dict_gets(ctx, stream, "Length"));
+    }
+    return size;
+}
+
+// MuPDF errors are longjmps, which must not cross the Qt containers a
+// fingerprint is built in: the calls that can throw are made from these
+// helpers, which hold nothing to destroy.
+static pdf_obj *lookupPage(fz_context *ctx, pdf_document *doc, int page)
+{
+    pdf_obj *obj = 0;
+    fz_try(ctx) {
+        obj = pdf_lookup_page_obj(ctx, doc, page);
+    }
+    fz_catch(ctx) {
+        obj = 0;
+    }
+    return obj;
+}
+
+static pdf_obj *lookupInherited(fz_context *ctx, pdf_document *doc, pdf_obj *page,
+                                const char *key, bool *ok)
+{
+    pdf_obj *obj = 0;
+    fz_try(ctx) {
+        obj = pdf_lookup_inherited_page_item(ctx, doc, page, key);
+    }
+    fz_catch(ctx) {
+        *ok = false;
+    }
+    return obj;
+}
+
+// The bytes of a stream as stored, or 0 if the object is not a stream.
+static fz_buffer *loadRawStream(fz_context *ctx, pdf_document *doc, int num, int gen,
+                                bool *ok)
+{
+    fz_buffer *buffer = 0;
+    fz_try(ctx) {
+        if (pdf_is_stream(ctx, doc, num, gen))
+            buffer = pdf_load_raw_stream(ctx, doc, num, gen);
+    }
+    fz_catch(ctx) {
+        *ok = false;
+    }
+    return buffer;
+}
 
-        pageCount = fz_count_pages(ctx, mdoc);
-        pdf_obj *obj = pdf_dict_gets(ctx, root, "PageMode");
-        if (obj && pdf_is_name(ctx, obj)) {
-            const char* mode = pdf_to_name(ctx, obj);
-            if (!std::strcmp(mode, "UseNone"))
-                pageMode = Document::UseNone;
-            else if (!std::strcmp(mode, "UseOutlines"))
-                pageMode = Document::UseOutlines;
-            else if (!std::strcmp(mode, "UseThumbs"))
-                pageMode = Document::UseThumbs;
-            else if (!std::strcmp(mode, "FullScreen"))
-                pageMode = Document::FullScreen;
-            else if (!std::strcmp(mode, "UseOC"))
-                pageMode = Document::UseOC;
-            else if (!std::strcmp(mode, "UseAttachments"))
-                pageMode = Document::UseAttachments;
+// Hashes the objects read for a fingerprint. The digest of an object in a
+// loop depends on where the loop was entered, so it is only good for the
+// page being fingerprinted: such objects are listed in partial.
+struct ObjectHasher {
+    ObjectHasher(const QHash<int, ObjectRecord> &r, const QHash<int, QByteArray> &known)
+        : records(r), digests(known) { }
+    QByteArray hash(const ObjectRecord &record, bool *complete)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(record.parts.at(0));
+        for (int i = 0; i < record.refs.count(); ++i) {
+            hash.addData(digestOf(record.refs.at(i), complete));
+            hash.addData(record.parts.at(i + 1));
         }
-        return true;
+        return hash.result();
     }
-    void convertOutline(fz_outline *out, Outline *item)
+    QByteArray digestOf(int num, bool *complete)
     {
-        for (; out; out = out->next) {
-            Outline *child = new Outline(out);
-            item->appendChild(child);
-            convertOutline(out->down, child);
+        if (hashing.contains(num)) {
+            *complete = false;
+            return QByteArray();
+        }
+        QHash<int, QByteArray>::const_iterator it = digests.constFind(num);
+        if (it != digests.constEnd()) {
+            if (partial.contains(num))
+                *complete = false;
+            return *it;
+        }
+        if (!records.contains(num))
+            return QByteArray();
+        hashing.insert(num);
+        bool own = true;
+        const QByteArray digest = hash(records.value(num), &own);
+        hashing.remove(num);
+        digests.insert(num, digest);
+        if (!own) {
+            partial.insert(num);
+            *complete = false;
         }
+        return digest;
     }
+    const QHash<int, ObjectRecord> &records;
+    QHash<int, QByteArray> digests;
+    QSet<int> hashing;
+    QSet<int> partial;
 };
 
+// What a page inherits from the page tree, which is otherwise left out.
+static const char * const inheritedKeys[] = { "Resources", "MediaBox", "CropBox", "Rotate" };
+
+// A digest of everything a page is drawn from: its dictionary, what it
+// inherits, contents and resources, down to the bytes of the streams.
+// Object numbers are left out, as a change to one page renumbers the
+// objects of all the following ones.
+//
+// Called with mutex held. The objects are read with it, and hashed without
+// it. Empty if the page cannot be read, or if the file changed on disk or
+// was closed meanwhile: what was read may then not be what the pages were
+// drawn from.
+QByteArray Document::Data::fingerprint(int page)
+{
+    QHash<int, QByteArray>::const_iterator it = fingerprints.constFind(page);
+    if (it != fingerprints.constEnd())
+        return *it;
+
+    pdf_obj *obj = lookupPage(ctx, pdf(), page);
+    if (!obj)
+        return QByteArray();
+    bool ok = true;
+    ObjectRecord top;
+    top.parts.append(QByteArray());
+    QVector<pdf_obj *> children;
+    if (pdf_is_indirect(ctx, obj)) {
+        top.refs.append(pdf_to_num(ctx, obj));
+        top.parts.append(QByteArray());
+        children.append(obj);
+    } else {
+        serializeObject(top, obj, children);
+    }
+    for (unsigned i = 0; i < sizeof(inheritedKeys) / sizeof(*inheritedKeys); ++i) {
+        top.parts.last() += '/';
+        top.parts.last() += inheritedKeys[i];
+        serializeObject(top, lookupInherited(ctx, pdf(), obj, inheritedKeys[i], &ok),
+                        children);
+    }
+    QHash<int, ObjectRecord> records;
+    QHash<int, QByteArray> digests;
+    foreach (pdf_obj *child, children)
+        readObject(child, records, digests, &ok);
+    if (!ok)
+        return QByteArray();
+
+    const int serial = loadSerial;
+    mutex.unlock();
+    ObjectHasher hasher(records, digests);
+    bool complete = true;
+    const QByteArray digest = hasher.hash(top, &complete);
+    mutex.lock();
+    if (serial != loadSerial || fileChanged())
+        return QByteArray();
+    // the objects are shared with other pages, e.g. fonts
+    foreach (int num, records.keys()) {
+        if (!hasher.partial.contains(num))
+            objectDigests.insert(num, hasher.digests.value(num));
+    }
+    fingerprints.insert(page, digest);
+    return digest;
+}
+
+// Reads ref and what it refers to into records, but for the objects
+// already hashed, which go to digests.
+void Document::Data::readObject(pdf_obj *ref, QHash<int, ObjectRecord> &records,
+                                QHash<int, QByteArray> &digests, bool *ok)
+{
+    const int num = pdf_to_num(ctx, ref);
+    if (records.contains(num) || digests.contains(num))
+        return;
+    QHash<int, QByteArray>::const_iterator it = objectDigests.constFind(num);
+    if (it != objectDigests.constEnd()) {
+        digests.insert(num, *it);
+        return;
+    }
+
+    ObjectRecord record;
+    record.parts.append(QByteArray());
+    QVector<pdf_obj *> children;
+    serializeObject(record, pdf_resolve_indirect(ctx, ref), children);
+    // as stored: decoding would only cost time
+    if (fz_buffer *buffer = loadRawStream(ctx, pdf(), num, pdf_to_gen(ctx, ref), ok)) {
+        record.parts.last().append(reinterpret_cast<const char *>(buffer->data),
+                                   buffer->len);
+        fz_drop_buffer(ctx, buffer);
+    }
+    records.insert(num, record);
+    foreach (pdf_obj *child, children)
+        readObject(child, records, digests, ok);
+}
+
+void Document::Data::serializeObject(ObjectRecord &record, pdf_obj *obj,
+                                     QVector<pdf_obj *> &children)
+{
+    QByteArray &bytes = record.parts.last();
+    if (pdf_is_indirect(ctx, obj)) {
+        // other pages, e.g. the targets of links, are not drawn on this one
+        pdf_obj *type = pdf_dict_gets(ctx, obj, "Type");
+        if (pdf_is_name(ctx, type) && !std::strcmp(pdf_to_name(ctx, type), "Page")) {
+            bytes += " R";
+        } else {
+            record.refs.append(pdf_to_num(ctx, obj));
+            record.parts.append(QByteArray());
+            children.append(obj);
+        }
+    } else if (pdf_is_dict(ctx, obj)) {
+        bytes += "<<";
+        const int count = pdf_dict_len(ctx, obj);
+        for (int i = 0; i < count; ++i) {
+            pdf_obj *key = pdf_dict_get_key(ctx, obj, i);
+            // the page tree is not part of the page
+            if (!std::strcmp(pdf_to_name(ctx, key), "Parent"))
+                continue;
+            serializeObject(record, key, children);
+            serializeObject(record, pdf_dict_get_val(ctx, obj, i), children);
+        }
+        record.parts.last() += ">>";
+    } else if (pdf_is_array(ctx, obj)) {
+        bytes += "[";
+        const int count = pdf_array_len(ctx, obj);
+        for (int i = 0; i < count; ++i)
+            serializeObject(record, pdf_array_get(ctx, obj, i), children);
+        record.parts.last() += "]";
+    } else if (pdf_is_name(ctx, obj)) {
+        bytes += "/";
+        bytes += pdf_to_name(ctx, obj);
+    } else if (pdf_is_string(ctx, obj)) {
+        bytes += "(";
+        bytes += QByteArray(pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+        bytes += ")";
+    } else if (pdf_is_int(ctx, obj)) {
+        bytes += " i" + QByteArray::number(pdf_to_int(ctx, obj));
+    } else if (pdf_is_real(ctx, obj)) {
+        bytes += " r" + QByteArray::number(pdf_to_real(ctx, obj));
+    } else if (pdf_is_bool(ctx, obj)) {
+        bytes += pdf_to_bool(ctx, obj) ? " true" : " false";
+    } else {
+        bytes += " null";
+    }
+}
+
+// Whether the file was written to since it was loaded.
+bool Document::Data::fileChanged() const
+{
+    if (fileName.isEmpty())
+        return false;
+    const QFileInfo info(fileName);
+    return info.size() != fileSize || info.lastModified() != fileModified;
+}
+
+// Takes the cached text and display list of every page that has been
+// fingerprinted, for the next load of the same file; only these pages can
+// be compared once the file has been rewritten.
+void Document::Data::keepPages()
+{
+    dropKeptPages();
+    if (fileName.isEmpty())
+        return;
+    keptFile = fileName;
+    keptPageCount = pageCount;
+    QMutexLocker listsLocker(&listsMutex);
+    QMutexLocker textsLocker(&textsMutex);
+    for (QHash<int, QByteArray>::const_iterator it = fingerprints.constBegin();
+         it != fingerprints.constEnd(); ++it) {
+        KeptPage kept;
+        kept.page = it.key();
+        kept.fingerprint = it.value();
+        kept.text = texts.take(kept.page);
+        kept.list = lists.take(kept.page);
+        if (kept.text || kept.list)
+            keptPages.append(kept);
+    }
+}
+
+void Document::Data::dropKeptPages()
+{
+    foreach (const KeptPage &kept, keptPages) {
+        delete kept.text;
+        delete kept.list;
+    }
+    keptPages.clear();
+    keptFile.clear();
+    keptPageCount = 0;
+}
+
+// Maps the whole file in memory: MuPDF then reads it through a memory
+// stream, where seeking and reading are pointer arithmetic, and the pages
+// are shared with other processes through the kernel page cache. Reading
+// a mapping past the end of a file truncated meanwhile raises SIGBUS, so
+// only files nobody may write to, e.g. installed manuals, are mapped.
+bool Document::Data::mapFile(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    if (!mapFiles)
+        return false;
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    // memory streams take an int length
+    if (fstat(fd, &st) == 0 && !(st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH))
+            && st.st_size > 0 && st.st_size <= INT_MAX) {
+        void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            mapping = static_cast<uchar *>(addr);
+            mappingSize = st.st_size;
+        }
+    }
+    ::close(fd);
+#else
+    Q_UNUSED(path)
+#endif
+    return mapping;
+}
+
+void Document::Data::unmapFile()
+{
+#ifdef Q_OS_UNIX
+    if (mapping)
+        munmap(mapping, mappingSize);
+#endif
+    mapping = 0;
+    mappingSize = 0;
+}
+
+// The cross reference table is read from start to end, objects are then
+// fetched in any order.
+void Document::Data::adviseAccess(bool sequential)
+{
+#ifdef Q_OS_UNIX
+    if (mapping)
+        madvise(mapping, mappingSize, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+#else
+    Q_UNUSED(sequential)
+#endif
+}
+
+// The object number of the first page, if the file is linearized: its
+// first object is then a dictionary with a Linearized key, the length of
+// the file in L and the number of the first page object in O. A file
+// saved incrementally since keeps a stale dictionary, which L tells.
+int Document::Data::linearizedFirstPage()
+{
+    char head[1024];
+    fz_off_t fileLength = 0;
+    int length = 0;
+    fz_try(ctx) {
+        fz_seek(ctx, stream, 0, SEEK_END);
+        fileLength = fz_tell(ctx, stream);
+        fz_seek(ctx, stream, 0, SEEK_SET);
+        length = fz_read(ctx, stream, reinterpret_cast<unsigned char *>(head),
+                         sizeof(head));
+    }
+    fz_catch(ctx) {
+        return 0;
+    }
+    const QString text = QString::fromLatin1(head, length);
+    QRegExp first(QLatin1String("(\\d+)\\s+(\\d+)\\s+obj\\s*<<"));
+    const int start = first.indexIn(text);
+    if (start < 0)
+        return 0;
+    const int num = first.cap(1).toInt();
+    const int gen = first.cap(2).toInt();
+
+    // MuPDF 1.8 reads numbers into an int, which L overflows in files
+    // past 2 GB, so it is read from the text of the dictionary instead
+    QRegExp lengthKey(QLatin1String("/L\\s+(\\d+)"));
+    const int end = text.indexOf(QLatin1String(">>"), start);
+    const int pos = lengthKey.indexIn(text, start);
+    if (pos < 0 || (end >= 0 && pos > end)
+            || lengthKey.cap(1).toLongLong() != qint64(fileLength))
+        return 0;
+
+    // the object number is only a guess
+    pdf_obj *dict = 0;
+    fz_try(ctx) {
+        dict = pdf_load_object(ctx, pdf(), num, gen);
+    }
+    fz_catch(ctx) {
+        return 0;
+    }
+    int page = 0;
+    if (pdf_dict_gets(ctx, dict, "Linearized")
+            && pdf_to_int(ctx, pdf_dict_gets(ctx, dict, "N")) == pageCount)
+        page = pdf_to_int(ctx, pdf_dict_gets(ctx, dict, "O"));
+    pdf_drop_obj(ctx, dict);
+    return page;
+}
+
 Document::Document()
     : d(new Data)
 {
@@ -82,42 +544,102 @@ Document::Document()
 Document::~Document()
 {
     close();
-    fz_drop_context(d->ctx);
+    d->dropKeptPages();
     delete d;
 }
 
 bool Document::load(const QString &fileName)
 {
-    QByteArray fileData = QFile::encodeName(fileName);
-    d->stream = fz_open_file(d->ctx, fileData.constData());
-    if (!d->stream)
+    QMutexLocker locker(&d->mutex);
+    d->fileName = fileName;
+    const QFileInfo info(fileName);
+    d->fileSize = info.size();
+    d->fileModified = info.lastModified();
+    if (d->mapFile(fileName)) {
+        d->adviseAccess(true);
+        d->stream = fz_open_memory(d->ctx, d->mapping, d->mappingSize);
+    } else {
+        QByteArray fileData = QFile::encodeName(fileName);
+        d->stream = fz_open_file(d->ctx, fileData.constData());
+    }
+    return d->open();
+}
+
+// Reads the document straight from data, which is shared, not copied, and
+// kept until the document is closed. Nothing is cached on disk for such
+// documents, as they have no file to be identified by.
+bool Document::load(const QByteArray &data)
+{
+    QMutexLocker locker(&d->mutex);
+    if (data.isEmpty())
         return false;
+    d->data = data;
+    // memory streams only read
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(
+        const_cast<char *>(d->data.constData()));
+    d->stream = fz_open_memory(d->ctx, bytes, d->data.size());
+    return d->open();
+}
+
+bool Document::Data::open()
+{
+    if (!stream)
+        return false;
+    ++loadSerial;
     char *oldlocale = std::setlocale(LC_NUMERIC, "C");
-    d->mdoc = fz_open_document_with_stream(d->ctx, "pdf", d->stream);
+    mdoc = fz_open_document_with_stream(ctx, "pdf", stream);
     if (oldlocale)
         std::setlocale(LC_NUMERIC, oldlocale);
-    if (!d->mdoc)
+    if (!mdoc)
         return false;
 
-    d->locked = fz_needs_password(d->ctx, d->mdoc);
+    locked = fz_needs_password(ctx, mdoc);
 
-    if (!d->locked) {
-        if (!d->load())
+    if (!locked) {
+        if (!load())
             return false;
     }
+    adviseAccess(false);
 
     return true;
 }
 
 void Document::close()
 {
-    if (!d->mdoc)
+    QMutexLocker locker(&d->mutex);
+    if (!d->mdoc) {
+        // a failed load may have left the file open
+        fz_drop_stream(d->ctx, d->stream);
+        d->stream = 0;
+        d->unmapFile();
+        d->data.clear();
+        d->fileName.clear();
         return;
+    }
 
+    d->keepPages();
+    // fingerprints being taken are dropped
+    ++d->loadSerial;
+    d->fingerprints.clear();
+    d->objectDigests.clear();
+    d->listsMutex.lock();
+    d->lists.clear();
+    d->listsMutex.unlock();
+    d->textsMutex.lock();
+    d->texts.clear();
+    d->textStats = CacheStats();
+    d->textsMutex.unlock();
+    d->pages.clear();
+    d->pageStats = CacheStats();
+    d->geometry.clear();
+    d->fileName.clear();
+    d->identity.clear();
     fz_drop_document(d->ctx, d->mdoc);
     d->mdoc = 0;
     fz_drop_stream(d->ctx, d->stream);
     d->stream = 0;
+    d->unmapFile();
+    d->data.clear();
     d->pageCount = 0;
     d->info = 0;
     d->pageMode = UseNone;
@@ -131,6 +653,7 @@ bool Document::isLocked() const
 
 bool Document::unlock(const QByteArray &password)
 {
+    QMutexLocker locker(&d->mutex);
     if (!d->locked)
         return false;
 
@@ -153,13 +676,206 @@ int Document::pageCount() const
 Page* Document::page(int pageno) const
 {
     if (d->mdoc && 0 <= pageno && pageno < d->pageCount)
-        return Page::make(d->ctx, d->mdoc, pageno);
+        return Page::make(this, pageno);
     return 0;
 }
 
+// Two pages with the same fingerprint, even in two versions of the file,
+// look the same; empty for pages out of range or that cannot be read.
+// Computing it reads everything the page uses, so it is best done off the
+// rendering path.
+QByteArray Document::pageFingerprint(int page) const
+{
+    QMutexLocker locker(&d->mutex);
+    if (!d->mdoc || d->locked || page < 0 || page >= d->pageCount)
+        return QByteArray();
+    return d->fingerprint(page);
+}
+
+// The fingerprints computed so far, keyed by page number.
+QHash<int, QByteArray> Document::pageFingerprints() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->fingerprints;
+}
+
+bool Document::hasChangedOnDisk() const
+{
+    return d->fileChanged();
+}
+
+// Puts back in the caches what close() kept of the pages that did not
+// change, when the same file is loaded again. A page is looked for at its
+// old number, then shifted by as many pages as were added or removed,
+// which is where it is when the change was before it. This fingerprints
+// the pages, so it is best done in the background after load().
+void Document::restoreKeptPages()
+{
+    QMutexLocker locker(&d->mutex);
+    if (!d->mdoc || d->locked || d->keptFile != d->fileName) {
+        d->dropKeptPages();
+        return;
+    }
+    const int serial = d->loadSerial;
+    const int shift = d->pageCount - d->keptPageCount;
+    const QList<KeptPage> kept = d->keptPages;
+    d->keptPages.clear();
+    d->keptFile.clear();
+    foreach (const KeptPage &old, kept) {
+        int page = -1;
+        if (old.page < d->pageCount && d->fingerprint(old.page) == old.fingerprint)
+            page = old.page;
+        else if (shift && old.page + shift >= 0 && old.page + shift < d->pageCount
+                 && d->fingerprint(old.page + shift) == old.fingerprint)
+            page = old.page + shift;
+        // fingerprint() unlocks the document, which may be closed meanwhile
+        if (page < 0 || serial != d->loadSerial) {
+            delete old.text;
+            delete old.list;
+            continue;
+        }
+        if (old.text) {
+            QMutexLocker textsLocker(&d->textsMutex);
+            d->texts.insert(page, old.text, old.text->memoryUsage() / 1024 + 1);
+        }
+        if (old.list) {
+            QMutexLocker listsLocker(&d->listsMutex);
+            d->lists.insert(page, old.list, d->contentsSize(d->ctx, page) / 1024 + 1);
+        }
+    }
+}
+
+// Fast path to the size and duration of all the pages, for documents with
+// many of them; only when the page tree looks broken are the pages loaded.
+// The result is kept in the cache directory, if any, for the next time the
+// same file is opened.
+QVector<PageGeometry> Document::pageGeometry() const
+{
+    QVector<PageGeometry> geometry;
+    QMutexLocker locker(&d->mutex);
+    if (!d->mdoc || d->locked || !d->geometry.isEmpty())
+        return d->geometry;
+    if (!d->readPageGeometry(geometry)) {
+        locker.unlock();
+        geometry.resize(d->pageCount);
+        for (int i = 0; i < geometry.count(); ++i) {
+            Page *p = page(i);
+            if (!p)
+                continue;
+            geometry[i].size = p->size(QSizeF(72, 72));
+            geometry[i].duration = p->duration();
+            delete p;
+        }
+        locker.relock();
+    }
+    d->geometry = geometry;
+    d->writeGeometryCache();
+    return geometry;
+}
+
+// What the geometry of the pages can be told without going through the
+// page tree: the cached geometry (exact is set to true), or that of the
+// first page for all of them (exact is set to false). Linearized files
+// name the first page object; for the others, it is looked up. This saves
+// walking the page tree, not reading the cross reference table, which
+// MuPDF has already done in full when opening the file.
+QVector<PageGeometry> Document::estimatedPageGeometry(bool *exact) const
+{
+    QMutexLocker locker(&d->mutex);
+    *exact = !d->geometry.isEmpty();
+    if (!d->mdoc || d->locked || *exact)
+        return d->geometry;
+
+    if (d->pageCount <= 0)
+        return QVector<PageGeometry>();
+    pdf_obj *page = 0;
+    const int first = d->linearizedFirstPage();
+    if (first > 0) {
+        fz_try(d->ctx) {
+            page = pdf_load_object(d->ctx, d->pdf(), first, 0);
+        }
+        fz_catch(d->ctx) {
+            page = 0;
+        }
+    }
+    pdf_obj *type = pdf_dict_gets(d->ctx, page, "Type");
+    PageGeometry geometry;
+    if (pdf_is_name(d->ctx, type) && !std::strcmp(pdf_to_name(d->ctx, type), "Page")) {
+        geometry = d->pageGeometry(page);
+    } else {
+        // a broken page tree gets the default page size
+        pdf_obj *obj = 0;
+        fz_try(d->ctx) {
+            obj = pdf_lookup_page_obj(d->ctx, d->pdf(), 0);
+        }
+        fz_catch(d->ctx) {
+            obj = 0;
+        }
+        geometry = d->pageGeometry(obj);
+    }
+    pdf_drop_obj(d->ctx, page);
+    return QVector<PageGeometry>(d->pageCount, geometry);
+}
+
+// Same as pageGeometry(), but the document is only locked for a few pages
+// of the page tree at a time, so pages can be rendered meanwhile. Returns
+// an empty vector if cookie is aborted.
+QVector<PageGeometry> Document::readPageGeometry(Cookie *cookie) const
+{
+    QVector<PageGeometry> geometry;
+    QVector<Data::PageTreeNode> stack;
+    QMutexLocker locker(&d->mutex);
+    if (!d->mdoc || d->locked || !d->geometry.isEmpty())
+        return d->geometry;
+    geometry.reserve(d->pageCount);
+    bool more = true;
+    fz_try(d->ctx) {
+        d->startPageTree(stack, geometry);
+    }
+    fz_catch(d->ctx) {
+        more = false;
+    }
+    while (more) {
+        if (cookie->isAborted()) {
+            d->dropPageTree(stack);
+            return QVector<PageGeometry>();
+        }
+        fz_try(d->ctx) {
+            more = d->readPageTree(stack, geometry, 64);
+        }
+        fz_catch(d->ctx) {
+            more = false;
+        }
+        locker.unlock();
+        QThread::yieldCurrentThread();
+        locker.relock();
+    }
+    d->dropPageTree(stack);
+
+    // as pageGeometry() does, load the pages if the tree looks broken
+    if (geometry.count() != d->pageCount) {
+        geometry.fill(PageGeometry(), d->pageCount);
+        for (int i = 0; i < geometry.count(); ++i) {
+            locker.unlock();
+            if (cookie->isAborted())
+                return QVector<PageGeometry>();
+            if (Page *p = page(i)) {
+                geometry[i].size = p->size(QSizeF(72, 72));
+                geometry[i].duration = p->duration();
+                delete p;
+            }
+            locker.relock();
+        }
+    }
+    d->geometry = geometry;
+    d->writeGeometryCache();
+    return geometry;
+}
+
 QList<QByteArray> Document::infoKeys() const
 {
     QList<QByteArray> keys;
+    QMutexLocker locker(&d->mutex);
     if (!d->mdoc)
         return keys;
 
@@ -179,6 +895,7 @@ QList<QByteArray> Document::infoKeys() const
 
 QString Document::infoKey(const QByteArray &key) const
 {
+    QMutexLocker locker(&d->mutex);
     if (!d->mdoc)
         return QString();
 
@@ -202,6 +919,7 @@ QString Document::infoKey(const QByteArray &key) const
 
 Outline* Document::outline() const
 {
+    QMutexLocker locker(&d->mutex);
     fz_outline *out = fz_load_outline(d->ctx, d->mdoc);
     if (!out)
         return 0;
@@ -216,6 +934,7 @@ Outline* Document::outline() const
 
 float Document::pdfVersion() const
 {
+    QMutexLocker locker(&d->mutex);
     if (!d->mdoc)
         return 0.0f;
     char buf[64];
@@ -232,6 +951,85 @@ Document::PageMode Document::pageMode() const
     return d->pageMode;
 }
 
+// Where to keep data about documents across sessions; an empty path (the
+// default) disables it.
+void Document::setCacheDirectory(const QString &path)
+{
+    QMutexLocker locker(&d->mutex);
+    d->cacheDir = path;
+}
+
+// Whether to read read-only files through a memory mapping rather than
+// with read() calls; off by default.
+void Document::setMemoryMapping(bool enabled)
+{
+    QMutexLocker locker(&d->mutex);
+    d->mapFiles = enabled;
+}
+
+// How much the cache directory may hold; the least recently written files
+// are removed beyond that. Defaults to 64 MB.
+void Document::setCacheDirectorySize(int kilobytes)
+{
+    QMutexLocker locker(&d->mutex);
+    d->cacheDirSize = qMax(0, kilobytes);
+}
+
+// Keep the display lists of recently shown pages, so rendering them again
+// (e.g. at another zoom level) does not interpret their contents again.
+// The cache is disabled by default.
+void Document::setDisplayListCacheSize(int kilobytes)
+{
+    QMutexLocker locker(&d->listsMutex);
+    d->lists.setMaxCost(qMax(0, kilobytes));
+}
+
+int Document::displayListCacheSize() const
+{
+    QMutexLocker locker(&d->listsMutex);
+    return d->lists.maxCost();
+}
+
+// Keep the most recently used pages loaded, as the same few pages are
+// asked for over and over (rendering, text, sizes).
+void Document::setPageCacheSize(int pages)
+{
+    QMutexLocker locker(&d->mutex);
+    d->pages.setMaxCost(qMax(0, pages));
+}
+
+int Document::pageCacheSize() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->pages.maxCost();
+}
+
+CacheStats Document::pageCacheStats() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->pageStats;
+}
+
+// Keep the text of the pages, which Okular asks for again and again when
+// searching, selecting or reading aloud.
+void Document::setTextCacheSize(int kilobytes)
+{
+    QMutexLocker locker(&d->textsMutex);
+    d->texts.setMaxCost(qMax(0, kilobytes));
+}
+
+int Document::textCacheSize() const
+{
+    QMutexLocker locker(&d->textsMutex);
+    return d->texts.maxCost();
+}
+
+CacheStats Document::textCacheStats() const
+{
+    QMutexLocker locker(&d->textsMutex);
+    return d->textStats;
+}
+
 /******************************************************************************/
 
 Outline::Outline(const fz_outline *out)
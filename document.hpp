@@ -10,6 +10,9 @@
 #ifndef QMUPDF_DOCUMENT_HPP
 #define QMUPDF_DOCUMENT_HPP
 
+#include <QtCore/QHash>
+#include <QtCore/QRectF>
+#include <QtCore/QSizeF>
 #include <QtCore/QString>
 #include <QtCore/QVector>
 #include <QtAlgorithms>
@@ -22,6 +25,19 @@ extern "C" {
 namespace QMuPDF {
 
 class Page;                             class Outline;
+class Cookie;
+
+struct PageGeometry {
+    PageGeometry(): duration(-1) { }
+    QSizeF size; // at 72 dpi, like Page::size()
+    qreal duration;
+};
+
+struct CacheStats {
+    CacheStats(): hits(0), misses(0) { }
+    int hits;
+    int misses;
+};
 
 class Document {
 public:
@@ -36,18 +52,38 @@ public:
     Document();
     ~Document();
     bool load(const QString &fileName);
+    bool load(const QByteArray &data);
     void close();
     bool isLocked() const;
     bool unlock(const QByteArray &password);
     int pageCount() const;
     Page *page(int page) const;
+    QByteArray pageFingerprint(int page) const;
+    QHash<int, QByteArray> pageFingerprints() const;
+    bool hasChangedOnDisk() const;
+    void restoreKeptPages();
+    QVector<PageGeometry> pageGeometry() const;
+    QVector<PageGeometry> estimatedPageGeometry(bool *exact) const;
+    QVector<PageGeometry> readPageGeometry(Cookie *cookie) const;
     QList<QByteArray> infoKeys() const;
     QString infoKey(const QByteArray &key) const;
     Outline *outline() const;
     float pdfVersion() const;
     PageMode pageMode() const;
+    void setDisplayListCacheSize(int kilobytes);
+    int displayListCacheSize() const;
+    void setPageCacheSize(int pages);
+    int pageCacheSize() const;
+    CacheStats pageCacheStats() const;
+    void setTextCacheSize(int kilobytes);
+    int textCacheSize() const;
+    CacheStats textCacheStats() const;
+    void setMemoryMapping(bool enabled);
+    void setCacheDirectory(const QString &path);
+    void setCacheDirectorySize(int kilobytes);
 private:
     Q_DISABLE_COPY(Document)
+    friend class Page;
     struct Data;
     Data *d;
 };
@@ -0,0 +1,340 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_DOCUMENT_P_HPP
+#define QMUPDF_DOCUMENT_P_HPP
+
+#include "document.hpp"
+#include "context.hpp"
+#include "page.hpp"
+#include <QtCore/QCache>
+#include <QtCore/QDateTime>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <cstring>
+extern "C" {
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+}
+
+namespace QMuPDF {
+
+struct DisplayList {
+    DisplayList(Context *c, fz_display_list *l): context(c), list(l) { }
+    ~DisplayList()
+    {
+        ScopedContext ctx(context);
+        fz_drop_display_list(ctx, list);
+    }
+    Context *context;
+    fz_display_list *list;
+};
+
+struct LoadedPage {
+    LoadedPage(fz_context *c, fz_page *p): ctx(c), page(p) { }
+    ~LoadedPage() { fz_drop_page(ctx, page); }
+    fz_context *ctx;
+    fz_page *page;
+};
+
+// The cached data of a page, kept by close() for the next load of the
+// same file.
+struct KeptPage {
+    int page;
+    QByteArray fingerprint;
+    TextLayout *text;
+    DisplayList *list;
+};
+
+// An object read for a fingerprint: what it holds, streams included, cut
+// where it refers to other objects, whose digests go in between.
+struct ObjectRecord {
+    QList<QByteArray> parts;
+    QVector<int> refs;
+};
+
+struct Document::Data {
+    Data()
+        : ctx(context.base())
+        , mdoc(0), stream(0), mapping(0), mappingSize(0), mapFiles(false)
+        , pageCount(0), info(0)
+        , pageMode(Document::UseNone), locked(false)
+        , cacheDirSize(64 * 1024), fileSize(0), loadSerial(0), keptPageCount(0)
+    {
+        pages.setMaxCost(16);
+        lists.setMaxCost(0);
+        texts.setMaxCost(8 * 1024);
+    }
+
+    Context context;
+    // guards mdoc and everything using ctx, the base context
+    QMutex mutex;
+    // recorded pages, keyed by page number; the cost is in kilobytes
+    QMutex listsMutex;
+    QCache<int, DisplayList> lists;
+    // text of the pages at 72 dpi, keyed by page number; the cost is in
+    // kilobytes
+    QMutex textsMutex;
+    QCache<int, TextLayout> texts;
+    CacheStats textStats;
+    fz_context *ctx;
+    fz_document *mdoc;
+    fz_stream *stream;
+    // the file, if mapped in memory; stream reads from it
+    uchar *mapping;
+    size_t mappingSize;
+    bool mapFiles;
+    // the document, when loaded from memory; stream reads from it
+    QByteArray data;
+    int pageCount;
+    pdf_obj *info;
+    PageMode pageMode;
+    bool locked;
+    QString fileName;
+    QString cacheDir;
+    // in kilobytes
+    int cacheDirSize;
+    // the file as it was loaded
+    qint64 fileSize;
+    QDateTime fileModified;
+    // changes on each load and close, so a fingerprint computed across one
+    // is dropped
+    int loadSerial;
+    QByteArray identity;
+    QVector<PageGeometry> geometry;
+    // loaded pages, keyed by page number; guarded by mutex
+    QCache<int, LoadedPage> pages;
+    CacheStats pageStats;
+    // what the pages look like, keyed by page number, and the digests of
+    // the objects they use; guarded by mutex
+    QHash<int, QByteArray> fingerprints;
+    QHash<int, QByteArray> objectDigests;
+    // what close() kept of keptFile, which had keptPageCount pages
+    QString keptFile;
+    int keptPageCount;
+    QList<KeptPage> keptPages;
+
+    pdf_document *pdf() const { return reinterpret_cast<pdf_document*>(mdoc); }
+    pdf_obj *dict(const char *key) const
+        { return pdf_dict_gets(ctx, pdf_trailer(ctx, pdf()), key); }
+    void loadInfoDict() { if (!info) info = dict("Info"); }
+    bool load()
+    {
+        pdf_obj *root = dict("Root");
+        if (!root)
+            return false;
+
+        pageCount = fz_count_pages(ctx, mdoc);
+        if (!cacheDir.isEmpty())
+            identity = fileIdentity();
+        readGeometryCache();
+        // what close() kept is only for the same file, see
+        // Document::restoreKeptPages()
+        if (keptFile != fileName)
+            dropKeptPages();
+        // the cache has it too
+        pdf_obj *obj = geometry.isEmpty() ? pdf_dict_gets(ctx, root, "PageMode") : 0;
+        if (obj && pdf_is_name(ctx, obj)) {
+            const char* mode = pdf_to_name(ctx, obj);
+            if (!std::strcmp(mode, "UseNone"))
+                pageMode = Document::UseNone;
+            else if (!std::strcmp(mode, "UseOutlines"))
+                pageMode = Document::UseOutlines;
+            else if (!std::strcmp(mode, "UseThumbs"))
+                pageMode = Document::UseThumbs;
+            else if (!std::strcmp(mode, "FullScreen"))
+                pageMode = Document::FullScreen;
+            else if (!std::strcmp(mode, "UseOC"))
+                pageMode = Document::UseOC;
+            else if (!std::strcmp(mode, "UseAttachments"))
+                pageMode = Document::UseAttachments;
+        }
+        return true;
+    }
+    bool open();
+    bool mapFile(const QString &path);
+    void unmapFile();
+    void adviseAccess(bool sequential);
+    QString cacheFile(const char *suffix) const;
+    QByteArray fileIdentity() const;
+    void readGeometryCache();
+    void writeGeometryCache() const;
+    void trimCacheDirectory() const;
+    QByteArray fingerprint(int page);
+    void readObject(pdf_obj *ref, QHash<int, ObjectRecord> &records,
+                    QHash<int, QByteArray> &digests, bool *ok);
+    void serializeObject(ObjectRecord &record, pdf_obj *obj,
+                         QVector<pdf_obj *> &children);
+    bool fileChanged() const;
+    void keepPages();
+    void dropKeptPages();
+    int contentsSize(fz_context *ctx, int page) const;
+    // Reads what fz_bound_page() and fz_page_presentation() would report
+    // straight from the page tree, without loading the pages; returns
+    // false if the tree does not match the page count.
+    bool readPageGeometry(QVector<PageGeometry> &geometry)
+    {
+        geometry.reserve(pageCount);
+        QVector<PageTreeNode> stack;
+        bool ok = true;
+        fz_try(ctx) {
+            startPageTree(stack, geometry);
+            readPageTree(stack, geometry, -1);
+        }
+        fz_catch(ctx) {
+            ok = false;
+        }
+        dropPageTree(stack);
+        return ok && geometry.count() == pageCount;
+    }
+    struct InheritedAttributes {
+        pdf_obj *mediaBox;
+        pdf_obj *cropBox;
+        pdf_obj *rotate;
+    };
+    // An inner node of the page tree being gone through, kept so the walk
+    // can go on after the document was unlocked, and the next of its kids.
+    // Nothing here needs destroying, so a MuPDF error can leave the walk;
+    // dropPageTree() is then still called.
+    struct PageTreeNode {
+        pdf_obj *node;
+        int next;
+        InheritedAttributes inherited;
+    };
+    void startPageTree(QVector<PageTreeNode> &stack, QVector<PageGeometry> &geometry)
+    {
+        const InheritedAttributes inherited = { 0, 0, 0 };
+        enterPageTree(stack, pdf_dict_gets(ctx, dict("Root"), "Pages"), inherited, geometry);
+    }
+    // Goes on through the page tree until count more pages are read, or
+    // to the end if count is negative; returns whether there is more.
+    bool readPageTree(QVector<PageTreeNode> &stack, QVector<PageGeometry> &geometry,
+                      int count)
+    {
+        const int end = geometry.count() + count;
+        while (!stack.isEmpty() && (count < 0 || geometry.count() < end)) {
+            PageTreeNode &parent = stack.last();
+            pdf_obj *kids = pdf_dict_gets(ctx, parent.node, "Kids");
+            if (parent.next >= pdf_array_len(ctx, kids)) {
+                pdf_drop_obj(ctx, parent.node);
+                stack.removeLast();
+                continue;
+            }
+            pdf_obj *node = pdf_array_get(ctx, kids, parent.next++);
+            const InheritedAttributes inherited = parent.inherited;
+            enterPageTree(stack, node, inherited, geometry);
+        }
+        return !stack.isEmpty();
+    }
+    void enterPageTree(QVector<PageTreeNode> &stack, pdf_obj *node,
+                       InheritedAttributes inherited, QVector<PageGeometry> &geometry)
+    {
+        if (pdf_obj *obj = pdf_dict_gets(ctx, node, "MediaBox"))
+            inherited.mediaBox = obj;
+        if (pdf_obj *obj = pdf_dict_gets(ctx, node, "CropBox"))
+            inherited.cropBox = obj;
+        if (pdf_obj *obj = pdf_dict_gets(ctx, node, "Rotate"))
+            inherited.rotate = obj;
+
+        pdf_obj *kids = pdf_dict_gets(ctx, node, "Kids");
+        pdf_obj *type = pdf_dict_gets(ctx, node, "Type");
+        const bool isPage = pdf_is_name(ctx, type)
+            ? !std::strcmp(pdf_to_name(ctx, type), "Page")
+            : !pdf_is_array(ctx, kids);
+        if (isPage) {
+            geometry.append(pageGeometry(node, inherited));
+            return;
+        }
+        // broken files can have loops in their page tree; objects are not
+        // marked, as other threads walk the tree while the document is
+        // unlocked
+        node = pdf_resolve_indirect(ctx, node);
+        for (int i = 0; i < stack.count(); ++i) {
+            if (stack.at(i).node == node)
+                return;
+        }
+        const PageTreeNode entry = { pdf_keep_obj(ctx, node), 0, inherited };
+        stack.append(entry);
+    }
+    void dropPageTree(QVector<PageTreeNode> &stack)
+    {
+        for (int i = 0; i < stack.count(); ++i)
+            pdf_drop_obj(ctx, stack.at(i).node);
+        stack.clear();
+    }
+    // the geometry of one page, looking up what it inherits itself
+    PageGeometry pageGeometry(pdf_obj *page)
+    {
+        InheritedAttributes inherited = { 0, 0, 0 };
+        // broken files can have loops in their page tree
+        QList<pdf_obj *> marked;
+        for (pdf_obj *node = page; node && !pdf_mark_obj(ctx, node);
+             node = pdf_dict_gets(ctx, node, "Parent")) {
+            marked.append(node);
+            if (!inherited.mediaBox)
+                inherited.mediaBox = pdf_dict_gets(ctx, node, "MediaBox");
+            if (!inherited.cropBox)
+                inherited.cropBox = pdf_dict_gets(ctx, node, "CropBox");
+            if (!inherited.rotate)
+                inherited.rotate = pdf_dict_gets(ctx, node, "Rotate");
+        }
+        foreach (pdf_obj *node, marked)
+            pdf_unmark_obj(ctx, node);
+        return pageGeometry(page, inherited);
+    }
+    int linearizedFirstPage();
+    // the same rules as pdf_load_page()
+    PageGeometry pageGeometry(pdf_obj *page, const InheritedAttributes &inherited)
+    {
+        pdf_obj *obj = pdf_dict_gets(ctx, page, "UserUnit");
+        const float userUnit = pdf_is_number(ctx, obj) ? pdf_to_real(ctx, obj) : 1;
+
+        fz_rect mediaBox, cropBox;
+        pdf_to_rect(ctx, inherited.mediaBox, &mediaBox);
+        if (fz_is_empty_rect(&mediaBox)) {
+            mediaBox.x0 = mediaBox.y0 = 0;
+            mediaBox.x1 = 612;
+            mediaBox.y1 = 792;
+        }
+        pdf_to_rect(ctx, inherited.cropBox, &cropBox);
+        if (!fz_is_empty_rect(&cropBox))
+            fz_intersect_rect(&mediaBox, &cropBox);
+        qreal width = qAbs(mediaBox.x1 - mediaBox.x0) * userUnit;
+        qreal height = qAbs(mediaBox.y1 - mediaBox.y0) * userUnit;
+        if (width < 1 || height < 1)
+            width = height = 1;
+
+        int rotate = pdf_to_int(ctx, inherited.rotate);
+        if (rotate < 0)
+            rotate = 360 - ((-rotate) % 360);
+        if (rotate >= 360)
+            rotate = rotate % 360;
+        rotate = 90 * ((rotate + 45) / 90);
+        if (rotate == 90 || rotate == 270)
+            qSwap(width, height);
+
+        PageGeometry geometry;
+        geometry.size = QSizeF(width, height);
+        const float duration = pdf_to_real(ctx, pdf_dict_gets(ctx, page, "Dur"));
+        geometry.duration = duration < 0.1 ? -1 : duration;
+        return geometry;
+    }
+    void convertOutline(fz_outline *out, Outline *item)
+    {
+        for (; out; out = out->next) {
+            Outline *child = new Outline(out);
+            item->appendChild(child);
+            convertOutline(out->down, child);
+        }
+    }
+};
+
+}
+
+#endif
@@ -9,38 +9,218 @@
 
 #include "generator_mupdf.hpp"
 #include "page.hpp"
+#include "prefetcher.hpp"
+#include "textpage.hpp"
+#include <qfuturewatcher.h>
 #include <qimage.h>
 #include <qmutex.h>
+#include <qpixmap.h>
+#include <qtextstream.h>
+#include <qthread.h>
+#include <qtconcurrentmap.h>
+#include <qtconcurrentrun.h>
+#include <qxmlstream.h>
 
 #include <kaboutdata.h>
+#include <kconfiggroup.h>
 #include <kdebug.h>
 #include <kglobal.h>
 #include <klocale.h>
+#include <kmimetype.h>
 #include <kpassworddialog.h>
+#include <kstandarddirs.h>
 #include <kwallet.h>
 
+#include <okular/core/observer.h>
 #include <okular/core/page.h>
 #include <okular/core/textpage.h>
+#include <okular/core/utils.h>
 
 static const int MuPDFDebug = 4716;
 
-static Okular::TextPage *buildTextPage(const QVector<QMuPDF::TextBox*> &boxes,
-                                       qreal width, qreal height)
-{
-    Okular::TextPage *ktp = new Okular::TextPage();
-    for (int i = 0; i < boxes.size(); ++i) {
-        QMuPDF::TextBox *box = boxes.at(i);
-        const QChar c = box->text();
-        const QRectF charBBox = box->rect();
-        QString text(c);
-        if (box->isAtEndOfLine()) {
-            text.append('\n');
+static bool isTile(Okular::PixmapRequest *request)
+{
+#if OKULAR_IS_VERSION(0, 16, 0)
+    return request->isTile();
+#else
+    Q_UNUSED(request)
+    return false;
+#endif
+}
+
+struct MuPDFGenerator::PixmapJob {
+    PixmapJob(Okular::PixmapRequest *r)
+        : request(r), textPage(0), unchanged(false)
+        , calcBoundingBox(!isTile(r) && !r->page()->isBoundingBoxKnown())
+        , calcTextPage(!r->page()->hasTextPage())
+        , watcher(new QFutureWatcher<void>) { }
+    Okular::PixmapRequest *request;
+    QImage image;
+    Okular::TextPage *textPage;
+    Okular::NormalizedRect boundingBox;
+    bool unchanged;
+    bool calcBoundingBox;
+    bool calcTextPage;
+    QMuPDF::Cookie cookie;
+    QFutureWatcher<void> *watcher;
+};
+
+static quintptr observerKey(Okular::PixmapRequest *request)
+{
+#if OKULAR_IS_VERSION(0, 16, 0)
+    return quintptr(request->observer());
+#else
+    return request->id();
+#endif
+}
+
+// Whether a request made before \p later is made useless by it: same page for
+// the same observer, but at another size.
+static bool isSupersededBy(Okular::PixmapRequest *request,
+                           Okular::PixmapRequest *later)
+{
+    if (observerKey(request) != observerKey(later))
+        return false;
+    return request->pageNumber() == later->pageNumber()
+        && (request->width() != later->width()
+            || request->height() != later->height());
+}
+
+static void setPagePixmap(Okular::PixmapRequest *request, const QImage &image)
+{
+    QPixmap *pixmap = new QPixmap(QPixmap::fromImage(image));
+#if OKULAR_IS_VERSION(0, 16, 0)
+    request->page()->setPixmap(request->observer(), pixmap,
+                               request->normalizedRect());
+#else
+    request->page()->setPixmap(request->id(), pixmap);
+#endif
+}
+
+static Okular::TextPage *createTextPage(const QMuPDF::Document *doc, int number,
+                                        const QSizeF &dpi, bool words)
+{
+    QMuPDF::Page *mp = doc->page(number);
+    if (!mp)
+        return 0;
+    const QMuPDF::TextLayout layout = mp->textLayout(dpi);
+    const QSizeF s = mp->size(dpi);
+    delete mp;
+
+    return buildTextPage(layout, s.width(), s.height(), words);
+}
+
+struct TextPageCreator {
+    typedef Okular::TextPage *result_type;
+    TextPageCreator(const QMuPDF::Document *d, const QSizeF &r, bool w)
+        : doc(d), dpi(r), words(w) { }
+    Okular::TextPage *operator()(int number) const
+        { return createTextPage(doc, number, dpi, words); }
+    const QMuPDF::Document *doc;
+    QSizeF dpi;
+    bool words;
+};
+
+struct ExportedPage {
+    int number;
+    QSizeF size; // at 72 dpi, like the layout
+    QMuPDF::TextLayout layout;
+};
+
+struct PageTextExtractor {
+    typedef ExportedPage result_type;
+    PageTextExtractor(const QMuPDF::Document *d): doc(d) { }
+    ExportedPage operator()(int number) const
+    {
+        ExportedPage exported;
+        exported.number = number;
+        if (QMuPDF::Page *page = doc->page(number)) {
+            exported.size = page->size(QSizeF(72, 72));
+            exported.layout = page->textLayout(QSizeF(72, 72));
+            delete page;
         }
-        ktp->append(text, new Okular::NormalizedRect(
-                        charBBox.left() / width, charBBox.top() / height,
-                        charBBox.right() / width, charBBox.bottom() / height));
+        return exported;
     }
-    return ktp;
+    const QMuPDF::Document *doc;
+};
+
+static QString layoutChar(const QMuPDF::TextLayout &layout, int i)
+{
+    const uint c = layout.charAt(i);
+    return c > 0xffff ? QString::fromUcs4(&c, 1) : QString(QChar(c));
+}
+
+// The text of the page, a line per line, ending with a form feed.
+static void writePlainText(QTextStream &stream, const ExportedPage &page)
+{
+    const QMuPDF::TextLayout &layout = page.layout;
+    for (int i = 0; i < layout.count(); ++i) {
+        stream << layoutChar(layout, i);
+        if (layout.isAtEndOfLine(i))
+            stream << '\n';
+    }
+    stream << '\f';
+}
+
+// XML 1.0 cannot hold most control characters, which broken ToUnicode
+// maps do produce
+static bool isXmlChar(uint c)
+{
+    return c == 0x9 || c == 0xa || c == 0xd
+        || (c >= 0x20 && c <= 0xd7ff) || (c >= 0xe000 && c <= 0xfffd)
+        || (c >= 0x10000 && c <= 0x10ffff);
+}
+
+static void writeXmlWord(QXmlStreamWriter &xml, const QString &text, const QRectF &bbox)
+{
+    xml.writeStartElement("word");
+    xml.writeAttribute("x0", QString::number(bbox.left()));
+    xml.writeAttribute("y0", QString::number(bbox.top()));
+    xml.writeAttribute("x1", QString::number(bbox.right()));
+    xml.writeAttribute("y1", QString::number(bbox.bottom()));
+    xml.writeCharacters(text);
+    xml.writeEndElement();
+}
+
+// <page> with its <line>s of <word>s, and their boxes in points.
+static void writeXmlPage(QXmlStreamWriter &xml, const ExportedPage &page)
+{
+    const QMuPDF::TextLayout &layout = page.layout;
+    xml.writeStartElement("page");
+    xml.writeAttribute("number", QString::number(page.number + 1));
+    xml.writeAttribute("width", QString::number(page.size.width()));
+    xml.writeAttribute("height", QString::number(page.size.height()));
+    QString word;
+    QRectF wordBBox;
+    bool inLine = false;
+    for (int i = 0; i < layout.count(); ++i) {
+        if (!inLine) {
+            xml.writeStartElement("line");
+            inLine = true;
+        }
+        // characters XML cannot hold are left out
+        const QString c = isXmlChar(layout.charAt(i)) ? layoutChar(layout, i) : QString();
+        const bool space = !c.isEmpty() && c.at(0).isSpace();
+        if (!c.isEmpty() && !space) {
+            word += c;
+            wordBBox |= layout.rect(i);
+        }
+        const bool endOfLine = layout.isAtEndOfLine(i);
+        if ((space || endOfLine) && !word.isEmpty()) {
+            writeXmlWord(xml, word, wordBBox);
+            word.clear();
+            wordBBox = QRectF();
+        }
+        if (endOfLine) {
+            xml.writeEndElement();
+            inLine = false;
+        }
+    }
+    if (!word.isEmpty())
+        writeXmlWord(xml, word, wordBBox);
+    if (inLine)
+        xml.writeEndElement();
+    xml.writeEndElement();
 }
 
 static void recurseCreateTOC(QDomDocument &mainDoc, QMuPDF::Outline *outline,
@@ -106,14 +286,46 @@ OKULAR_EXPORT_PLUGIN(MuPDFGenerator, createAboutData())
 MuPDFGenerator::MuPDFGenerator(QObject *parent, const QVariantList &args)
     : Generator(parent, args)
     , m_docSyn(0)
+    , m_prefetcher(new QMuPDF::Prefetcher(&m_pdfdoc))
+    , m_prefetchObserver(0), m_prefetchArea(0), m_prefetchPresentation(false)
+    , m_lastPage(-1), m_direction(1)
+    , m_keptPageCount(0), m_restoreWatcher(0)
+    , m_textWatcher(0)
+    , m_geometryWatcher(0), m_geometryCookie(0)
     , synctex_scanner(0)
 {
     setFeature(Threaded);
     setFeature(TextExtraction);
+    setFeature(ReadRawData);
+#if OKULAR_IS_VERSION(0, 16, 0)
+    setFeature(TiledRendering);
+#endif
+
+    const KConfigGroup group(KGlobal::config(), "MuPDF");
+    m_pdfdoc.setDisplayListCacheSize(group.readEntry("DisplayListCacheSize", 0));
+    m_pdfdoc.setPageCacheSize(group.readEntry("PageCacheSize", 16));
+    m_pdfdoc.setMemoryMapping(group.readEntry("MapReadOnlyFiles", false));
+    m_pdfdoc.setTextCacheSize(group.readEntry("TextCacheSize", 8 * 1024));
+    if (group.readEntry("PersistentCache", true))
+        m_pdfdoc.setCacheDirectory(KGlobal::dirs()->saveLocation("cache", "okular-mupdf/"));
+    m_pdfdoc.setCacheDirectorySize(group.readEntry("PersistentCacheSize", 64 * 1024));
+    m_prefetchPages = group.readEntry("PrefetchPages", 2);
+    m_extractText = group.readEntry("ExtractTextInBackground", false);
+    m_wordTextEntries = group.readEntry("WordTextEntries", false);
+    m_progressiveLoading = group.readEntry("ProgressiveLoading", false);
+    m_keepPages = group.readEntry("KeepPagesOnReload", false);
+
+    m_rendered.setMaxCost(m_keepPages ? 32 * 1024 : 0);
+    if (m_prefetchPages > 0)
+        m_prefetcher->start(QThread::IdlePriority);
 }
 
 MuPDFGenerator::~MuPDFGenerator()
 {
+    stopTextExtraction();
+    stopReadingPageGeometry();
+    stopRestoringPages();
+    delete m_prefetcher;
 }
 
 #if OKULAR_IS_VERSION(0, 20, 0)
@@ -121,8 +333,35 @@ Okular::Document::OpenResult MuPDFGenerator::loadDocumentWithPassword(
     const QString &fileName, QVector<Okular::Page*> &pages,
     const QString &password)
 {
-    if (!m_pdfdoc.load(fileName))
+    if (!m_pdfdoc.load(fileName)) {
+        m_pdfdoc.close();
         return Okular::Document::OpenError;
+    }
+    const Okular::Document::OpenResult result = init(pages, password);
+    if (result == Okular::Document::OpenSuccess) {
+        startRestoringPages(fileName);
+        // no need to check for the existence of a synctex file, no parser will 
+        // be created if none exists
+        initSynctexParser(fileName);
+    }
+    return result;
+}
+
+Okular::Document::OpenResult MuPDFGenerator::loadDocumentFromDataWithPassword(
+    const QByteArray &fileData, QVector<Okular::Page*> &pages,
+    const QString &password)
+{
+    if (!m_pdfdoc.load(fileData)) {
+        m_pdfdoc.close();
+        return Okular::Document::OpenError;
+    }
+    startRestoringPages(QString());
+    return init(pages, password);
+}
+
+Okular::Document::OpenResult MuPDFGenerator::init(QVector<Okular::Page*> &pages,
+                                                  const QString &password)
+{
     if (m_pdfdoc.isLocked()) {
         m_pdfdoc.unlock(password.toLatin1());
         if (m_pdfdoc.isLocked()) {
@@ -131,32 +370,42 @@ Okular::Document::OpenResult MuPDFGenerator::loadDocumentWithPassword(
         }
     }
     Q_ASSERT(!m_pdfdoc.isLocked());
-    
-    if (!m_pdfdoc.isLocked())
-    {
-        loadPages(pages);
-        // no need to check for the existence of a synctex file, no parser will 
-        // be created if none exists
-        initSynctexParser(fileName);
-        return Okular::Document::OpenSuccess;
-    }
-    else return Okular::Document::OpenError;
+
+    loadPages(pages);
+    startReadingOutline();
+    startTextExtraction();
+    return Okular::Document::OpenSuccess;
 }
 #else
 bool MuPDFGenerator::loadDocument(const QString &filePath,
                                   QVector<Okular::Page*> &pages)
 {
-    if (!m_pdfdoc.load(filePath))
+    if (!m_pdfdoc.load(filePath)) {
+        m_pdfdoc.close();
         return false;
+    }
     bool success = init(pages, filePath.section('/', -1, -1));
     if (success)
     {
+        startRestoringPages(filePath);
         // no need to check for the existence of a synctex file, no parser will 
         // be created if none exists
         initSynctexParser(filePath);
     }
     return success;
 }
+
+bool MuPDFGenerator::loadDocumentFromData(const QByteArray &fileData,
+                                          QVector<Okular::Page*> &pages)
+{
+    if (!m_pdfdoc.load(fileData)) {
+        m_pdfdoc.close();
+        return false;
+    }
+    startRestoringPages(QString());
+    // without a file name, there is no key for the wallet
+    return init(pages, QString());
+}
     
 bool MuPDFGenerator::init(QVector<Okular::Page *> &pages, const QString &wkey)
 {
@@ -226,6 +475,8 @@ bool MuPDFGenerator::init(QVector<Okular::Page *> &pages, const QString &wkey)
     }
 
     loadPages(pages);
+    startReadingOutline();
+    startTextExtraction();
 
     return true;
 }
@@ -233,12 +484,66 @@ bool MuPDFGenerator::init(QVector<Okular::Page *> &pages, const QString &wkey)
 
 bool MuPDFGenerator::doCloseDocument()
 {
+    const QMuPDF::CacheStats stats = m_pdfdoc.pageCacheStats();
+    kDebug(MuPDFDebug) << "page cache:" << stats.hits << "hits,"
+                       << stats.misses << "misses";
+    const QMuPDF::CacheStats texts = m_pdfdoc.textCacheStats();
+    kDebug(MuPDFDebug) << "text cache:" << texts.hits << "hits,"
+                       << texts.misses << "misses";
+
+    stopTextExtraction();
+    stopReadingPageGeometry();
+
+    // the requests belong to Okular, which drops them on close
+    foreach (PixmapJob *job, m_pixmapJobs)
+        job->cookie.abort();
+    foreach (PixmapJob *job, m_pixmapJobs) {
+        job->watcher->waitForFinished();
+        delete job->watcher;
+        delete job->textPage;
+        m_prefetcher->resume();
+    }
+    qDeleteAll(m_pixmapJobs);
+    m_pixmapJobs.clear();
+
+    m_prefetcher->clear();
+    const QMuPDF::CacheStats prefetched = m_prefetcher->stats();
+    kDebug(MuPDFDebug) << "prefetcher:" << prefetched.hits << "hits,"
+                       << prefetched.misses << "misses";
+    m_prefetchObserver = 0;
+    m_prefetchArea = 0;
+    m_prefetchPresentation = false;
+    m_lastPage = -1;
+    m_direction = 1;
+    m_pages.clear();
+
+    if (!m_outlineFuture.isCanceled())
+        delete takeOutline();
+
+    // kept for the next load of the same file, see startRestoringPages();
+    // an image is only worth keeping if its page got a fingerprint
+    stopRestoringPages();
+    m_fingerprinting.waitForFinished();
+    m_fingerprinting.clearFutures();
+    m_fingerprinted.clear();
+    const QHash<int, QByteArray> fingerprints = m_pdfdoc.pageFingerprints();
+    foreach (int page, m_rendered.keys()) {
+        RenderedImage *rendered = m_rendered.take(page);
+        rendered->fingerprint = fingerprints.value(page);
+        if (rendered->fingerprint.isEmpty())
+            delete rendered;
+        else
+            m_keptImages.insert(page, rendered);
+    }
+    m_keptPageCount = m_pdfdoc.pageCount();
+
     userMutex()->lock();
     m_pdfdoc.close();
     userMutex()->unlock();
     delete m_docSyn;
     m_docSyn = 0;
     
+    waitForSynctexParser();
     if ( synctex_scanner )
     {
         synctex_scanner_free( synctex_scanner );
@@ -248,27 +553,265 @@ bool MuPDFGenerator::doCloseDocument()
     return true;
 }
 
+// Okular reloads a document that changed on disk by closing and opening it
+// again. What was kept of the pages that look the same as before, e.g. all
+// but one after a LaTeX run, is put back in the background: QMuPDF::Document
+// restores its caches, and the images of those pages are moved to their new
+// numbers so they are not rendered again. Until then the images are not
+// used, as they may belong to pages that changed.
+void MuPDFGenerator::startRestoringPages(const QString &fileName)
+{
+    const bool same = !fileName.isEmpty() && fileName == m_keptFile;
+    m_keptFile = fileName;
+    if (!m_keepPages || !same) {
+        qDeleteAll(m_keptImages);
+        m_keptImages.clear();
+        return;
+    }
+    QHash<int, QByteArray> fingerprints;
+    for (QHash<int, RenderedImage*>::const_iterator it = m_keptImages.constBegin();
+         it != m_keptImages.constEnd(); ++it)
+        fingerprints.insert(it.key(), it.value()->fingerprint);
+    m_restoreWatcher = new QFutureWatcher<QHash<int, int> >;
+    connect(m_restoreWatcher, SIGNAL(finished()), this, SLOT(pagesRestored()));
+    m_restoreWatcher->setFuture(QtConcurrent::run(
+        this, &MuPDFGenerator::restorePages, fingerprints, m_keptPageCount));
+}
+
+// Returns the new number of each page of fingerprints, looked for as
+// QMuPDF::Document does for its caches; the file had pageCount pages.
+QHash<int, int> MuPDFGenerator::restorePages(const QHash<int, QByteArray> &fingerprints,
+                                             int pageCount)
+{
+    m_pdfdoc.restoreKeptPages();
+    const int shift = m_pdfdoc.pageCount() - pageCount;
+    QHash<int, int> numbers;
+    for (QHash<int, QByteArray>::const_iterator it = fingerprints.constBegin();
+         it != fingerprints.constEnd(); ++it) {
+        const int page = it.key();
+        if (m_pdfdoc.pageFingerprint(page) == it.value())
+            numbers.insert(page, page);
+        else if (shift && m_pdfdoc.pageFingerprint(page + shift) == it.value())
+            numbers.insert(page, page + shift);
+    }
+    return numbers;
+}
+
+void MuPDFGenerator::pagesRestored()
+{
+    if (sender() != m_restoreWatcher)
+        return;
+    const QHash<int, int> numbers = m_restoreWatcher->result();
+    // we are called by the watcher, so it cannot be deleted right away
+    m_restoreWatcher->deleteLater();
+    m_restoreWatcher = 0;
+    for (QHash<int, RenderedImage*>::const_iterator it = m_keptImages.constBegin();
+         it != m_keptImages.constEnd(); ++it) {
+        const int page = numbers.value(it.key(), -1);
+        // a page rendered meanwhile, or that two old pages look like,
+        // keeps the image it has
+        if (page < 0 || m_rendered.contains(page))
+            delete it.value();
+        else
+            m_rendered.insert(page, it.value(), it.value()->image.byteCount() / 1024 + 1);
+    }
+    m_keptImages.clear();
+}
+
+void MuPDFGenerator::stopRestoringPages()
+{
+    if (m_restoreWatcher) {
+        m_restoreWatcher->waitForFinished();
+        delete m_restoreWatcher;
+        m_restoreWatcher = 0;
+    }
+    qDeleteAll(m_keptImages);
+    m_keptImages.clear();
+}
+
 void MuPDFGenerator::loadPages(QVector<Okular::Page *> &pages)
 {
-    pages.resize(m_pdfdoc.pageCount());
+    // the first page can be found without walking the whole page tree:
+    // show the document with it, and read the others in the background
+    QVector<QMuPDF::PageGeometry> geometry;
+    bool exact = true;
+    if (m_progressiveLoading)
+        geometry = m_pdfdoc.estimatedPageGeometry(&exact);
+    if (geometry.isEmpty()) {
+        geometry = m_pdfdoc.pageGeometry();
+        exact = true;
+    }
+    pages.resize(geometry.count());
 
+    const QSizeF scale = dpi() / 72.;
     for (int i = 0; i < pages.count(); ++i) {
-        QMuPDF::Page *page = m_pdfdoc.page(i);
-        const QSizeF s = page->size(dpi());
+        const QSizeF s(geometry.at(i).size.width() * scale.width(),
+                       geometry.at(i).size.height() * scale.height());
         const Okular::Rotation rot = Okular::Rotation0;
         Okular::Page* new_ = new Okular::Page(i, s.width(), s.height(), rot);
-        new_->setDuration(page->duration());
+        new_->setDuration(geometry.at(i).duration);
         pages[i] = new_;
-        delete page;
+    }
+    m_pages = pages;
+
+    if (!exact) {
+        m_estimatedGeometry = geometry;
+        m_geometryCookie = new QMuPDF::Cookie;
+        m_geometryWatcher = new QFutureWatcher<QVector<QMuPDF::PageGeometry> >;
+        connect(m_geometryWatcher, SIGNAL(finished()), this, SLOT(pageGeometryRead()));
+        m_geometryWatcher->setFuture(QtConcurrent::run(
+            &m_pdfdoc, &QMuPDF::Document::readPageGeometry, m_geometryCookie));
     }
 }
 
-void MuPDFGenerator::initSynctexParser ( const QString& filePath )
+// Okular pages cannot be resized once the document is loaded: pages that
+// do not have the size of the first one keep it until the document is
+// opened again, which then uses the cached geometry, so the user is told
+// to reload it.
+void MuPDFGenerator::pageGeometryRead()
+{
+    if (sender() != m_geometryWatcher)
+        return;
+    const QVector<QMuPDF::PageGeometry> geometry = m_geometryWatcher->result();
+    int wrong = 0;
+    for (int i = 0; i < geometry.count() && i < m_estimatedGeometry.count(); ++i) {
+        if (geometry.at(i).size != m_estimatedGeometry.at(i).size)
+            ++wrong;
+        else if (geometry.at(i).duration != m_estimatedGeometry.at(i).duration)
+            m_pages.at(i)->setDuration(geometry.at(i).duration);
+    }
+    kDebug(MuPDFDebug) << "page geometry read," << wrong
+                       << "pages differ from the first one";
+    m_estimatedGeometry.clear();
+    if (wrong > 0)
+        emit warning(i18np("One page is shown with the wrong size. Reload the document to fix it.",
+                           "%1 pages are shown with the wrong size. Reload the document to fix them.",
+                           wrong), -1);
+}
+
+void MuPDFGenerator::stopReadingPageGeometry()
+{
+    if (!m_geometryWatcher)
+        return;
+    m_geometryCookie->abort();
+    m_geometryWatcher->waitForFinished();
+    delete m_geometryWatcher;
+    m_geometryWatcher = 0;
+    delete m_geometryCookie;
+    m_geometryCookie = 0;
+    m_estimatedGeometry.clear();
+}
+
+// Extracts the text of all the pages on the global thread pool, so the
+// first search does not have to. The text pages are handed to Okular as
+// they are ready; pages that got theirs meanwhile are skipped. Okular then
+// holds the text of every page, and the text cache only the last ones, so
+// this is off by default.
+void MuPDFGenerator::startTextExtraction()
+{
+    if (!m_extractText || m_pages.isEmpty())
+        return;
+
+    QList<int> numbers;
+    for (int i = 0; i < m_pages.count(); ++i)
+        numbers.append(i);
+    m_textDelivered.fill(false, numbers.count());
+    m_textWatcher = new QFutureWatcher<Okular::TextPage*>;
+    connect(m_textWatcher, SIGNAL(resultReadyAt(int)), this, SLOT(textPageReady(int)));
+    connect(m_textWatcher, SIGNAL(progressValueChanged(int)),
+            this, SLOT(textExtractionProgress(int)));
+    connect(m_textWatcher, SIGNAL(finished()), this, SLOT(textExtractionFinished()));
+    m_textTimer.start();
+    const TextPageCreator creator(&m_pdfdoc, dpi(), m_wordTextEntries);
+    m_textWatcher->setFuture(QtConcurrent::mapped(numbers, creator));
+}
+
+void MuPDFGenerator::stopTextExtraction()
+{
+    if (!m_textWatcher)
+        return;
+    m_textWatcher->cancel();
+    m_textWatcher->resume();
+    m_textWatcher->waitForFinished();
+    // whatever was not delivered yet is ours
+    const QFuture<Okular::TextPage*> future = m_textWatcher->future();
+    for (int i = 0; i < m_textDelivered.count(); ++i) {
+        if (!m_textDelivered.at(i) && future.isResultReadyAt(i))
+            delete future.resultAt(i);
+    }
+    delete m_textWatcher;
+    m_textWatcher = 0;
+    m_textDelivered.clear();
+}
+
+void MuPDFGenerator::textPageReady(int index)
+{
+    if (sender() != m_textWatcher)
+        return;
+    Okular::TextPage *textPage = m_textWatcher->resultAt(index);
+    m_textDelivered[index] = true;
+    Okular::Page *page = m_pages.value(index);
+    if (textPage && page && !page->hasTextPage()) {
+        page->setTextPage(textPage);
+        signalTextGenerationDone(page, textPage);
+    } else {
+        delete textPage;
+    }
+}
+
+void MuPDFGenerator::textExtractionProgress(int value)
+{
+    const int maximum = m_textWatcher ? m_textWatcher->progressMaximum() : 0;
+    if (maximum > 0 && value * 10 / maximum != (value - 1) * 10 / maximum)
+        kDebug(MuPDFDebug) << "text extraction:" << value << "of" << maximum << "pages";
+}
+
+void MuPDFGenerator::textExtractionFinished()
+{
+    if (sender() != m_textWatcher || m_textWatcher->isCanceled())
+        return;
+    kDebug(MuPDFDebug) << "text of" << m_pages.count() << "pages extracted in"
+                       << m_textTimer.elapsed() << "ms";
+}
+
+static synctex_scanner_t openSynctexScanner(const QString &filePath)
 {
-    synctex_scanner = synctex_scanner_new_with_output_file( QFile::encodeName( 
+    return synctex_scanner_new_with_output_file( QFile::encodeName( 
     filePath ), 0, 1);
 }
 
+// Parsing the SyncTeX file can take a while for big documents: it is done
+// in the background, and waited for when first needed.
+void MuPDFGenerator::initSynctexParser ( const QString& filePath )
+{
+    m_synctexFuture = QtConcurrent::run(openSynctexScanner, filePath);
+}
+
+void MuPDFGenerator::waitForSynctexParser() const
+{
+    // a default constructed future is canceled
+    if (m_synctexFuture.isCanceled())
+        return;
+    synctex_scanner = m_synctexFuture.result();
+    m_synctexFuture = QFuture<synctex_scanner_t>();
+}
+
+// The outline is read in the background right after the document is
+// loaded, so it is likely ready when Okular asks for it.
+void MuPDFGenerator::startReadingOutline()
+{
+    m_outlineFuture = QtConcurrent::run(&m_pdfdoc, &QMuPDF::Document::outline);
+}
+
+QMuPDF::Outline *MuPDFGenerator::takeOutline()
+{
+    if (m_outlineFuture.isCanceled())
+        return m_pdfdoc.outline();
+    QMuPDF::Outline *outline = m_outlineFuture.result();
+    m_outlineFuture = QFuture<QMuPDF::Outline*>();
+    return outline;
+}
+
 Okular::DocumentInfo MuPDFGenerator::generateDocumentInfo(const QSet<Okular::DocumentInfo::Key> &keys) const
 {
     Okular::DocumentInfo info;
@@ -294,9 +837,7 @@ const Okular::DocumentSynopsis* MuPDFGenerator::generateDocumentSynopsis()
     if (m_docSyn)
         return m_docSyn;
 
-    userMutex()->lock();
-    QMuPDF::Outline* outline = m_pdfdoc.outline();
-    userMutex()->unlock();
+    QMuPDF::Outline* outline = takeOutline();
     if (!outline)
         return 0;
 
@@ -310,6 +851,7 @@ const Okular::DocumentSynopsis* MuPDFGenerator::generateDocumentSynopsis()
 const Okular::SourceReference * MuPDFGenerator::dynamicSourceReference( int 
                                 pageNr, double absX, double absY )
 {
+    waitForSynctexParser();
     if  ( !synctex_scanner )
         return 0;
     
@@ -338,12 +880,275 @@ const Okular::SourceReference * MuPDFGenerator::dynamicSourceReference( int
     return 0;
 }
 
+Okular::ExportFormat::List MuPDFGenerator::exportFormats() const
+{
+    static Okular::ExportFormat::List formats;
+    if (formats.isEmpty()) {
+        formats.append(Okular::ExportFormat::standardFormat(Okular::ExportFormat::PlainText));
+        formats.append(Okular::ExportFormat(i18n("Text Layout (XML)"),
+                                            KMimeType::mimeType("application/xml")));
+    }
+    return formats;
+}
+
+// Pages are extracted a few at a time, in parallel, and written in order
+// as soon as they are ready, so memory use does not grow with the size of
+// the document.
+bool MuPDFGenerator::exportTo(const QString &fileName,
+                              const Okular::ExportFormat &format)
+{
+    const QString mimeType = format.mimeType()->name();
+    const bool xml = mimeType == QLatin1String("application/xml");
+    if (!xml && mimeType != QLatin1String("text/plain"))
+        return false;
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    QTextStream *text = 0;
+    QXmlStreamWriter *writer = 0;
+    if (xml) {
+        writer = new QXmlStreamWriter(&file);
+        writer->setAutoFormatting(true);
+        writer->writeStartDocument();
+        writer->writeStartElement("document");
+        writer->writeAttribute("pages", QString::number(m_pdfdoc.pageCount()));
+    } else {
+        text = new QTextStream(&file);
+        text->setCodec("UTF-8");
+    }
+
+    const int count = m_pdfdoc.pageCount();
+    const int window = qMax(1, QThread::idealThreadCount()) * 4;
+    for (int first = 0; first < count && file.error() == QFile::NoError; first += window) {
+        QList<int> numbers;
+        for (int i = first; i < qMin(first + window, count); ++i)
+            numbers.append(i);
+        const QList<ExportedPage> pages = QtConcurrent::blockingMapped<QList<ExportedPage> >(
+            numbers, PageTextExtractor(&m_pdfdoc));
+        foreach (const ExportedPage &page, pages) {
+            if (xml)
+                writeXmlPage(*writer, page);
+            else
+                writePlainText(*text, page);
+        }
+        if (text)
+            text->flush();
+    }
+
+    bool ok;
+    if (xml) {
+        writer->writeEndDocument();
+        ok = !writer->hasError();
+        delete writer;
+    } else {
+        text->flush();
+        ok = text->status() == QTextStream::Ok;
+        delete text;
+    }
+    file.close();
+    return ok && file.error() == QFile::NoError;
+}
+
+// Superseded jobs finish in the background, bounded by the thread count.
+bool MuPDFGenerator::canGeneratePixmap() const
+{
+    return m_pixmapJobs.count() < qMax(1, QThread::idealThreadCount());
+}
+
+// Pixmaps are rendered on the global thread pool rather than on the single
+// thread Okular provides. Okular sends the next request only once this one
+// is done, so requests do not overlap each other, but they do run next to
+// the prefetcher and the text extraction, and a superseded request no
+// longer holds up the one replacing it. Interpreting a page is serialized
+// by the document mutex in any case; only rasterizing runs in parallel.
+void MuPDFGenerator::generatePixmap(Okular::PixmapRequest *request)
+{
+    m_prefetcher->yield();
+    if (!request->asynchronous()) {
+        const QImage img = image(request);
+        setPagePixmap(request, img);
+        // as Okular's own generatePixmap() does for full pages
+        if (!isTile(request) && !request->page()->isBoundingBoxKnown())
+            updatePageBoundingBox(request->pageNumber(),
+                                  Okular::Utils::imageBoundingBox(&img));
+        m_prefetcher->resume();
+        signalPixmapRequestDone(request);
+        return;
+    }
+
+    foreach (PixmapJob *job, m_pixmapJobs) {
+        if (isSupersededBy(job->request, request))
+            job->cookie.abort();
+    }
+    // what is on screen goes before the text of the other pages
+    if (m_textWatcher)
+        m_textWatcher->pause();
+
+    PixmapJob *job = new PixmapJob(request);
+    if (!isTile(request)) {
+        const QSize size(request->width(), request->height());
+        if (schedulePrefetch(request))
+            job->image = m_prefetcher->take(request->pageNumber(), size);
+        const RenderedImage *rendered = m_rendered.object(request->pageNumber());
+        if (job->image.isNull() && rendered && rendered->image.size() == size)
+            job->image = rendered->image;
+    }
+    connect(job->watcher, SIGNAL(finished()), this, SLOT(pixmapJobFinished()));
+    m_pixmapJobs.append(job);
+    job->watcher->setFuture(QtConcurrent::run(this, &MuPDFGenerator::runPixmapJob, job));
+}
+
+// Guesses the next pages from the way the user is going through the
+// document, and renders them ahead in the background. In presentation
+// mode this is simply the following pages. Returns whether the request
+// comes from the view that is followed, the only one that can have
+// prefetched pages.
+bool MuPDFGenerator::schedulePrefetch(Okular::PixmapRequest *request)
+{
+    if (m_prefetchPages <= 0)
+        return false;
+
+    // the presentation covers the screen, and its own preloading of the
+    // next slide would otherwise look like the user going back and forth;
+    // elsewhere follow the view with the biggest pages, not the thumbnails.
+    // Okular does not say when a presentation ends, so one that has been
+    // quiet for a while gives way to the views behind it.
+    const bool presentation = request->priority() == PRESENTATION_PRIO;
+    const quintptr observer = observerKey(request);
+    const qint64 area = qint64(request->width()) * request->height();
+    const bool presentationEnded = m_prefetchPresentation
+                                   && m_prefetchClock.elapsed() > 2000;
+    if (!presentation && observer != m_prefetchObserver && area < m_prefetchArea
+        && !presentationEnded)
+        return false;
+    m_prefetchObserver = observer;
+    m_prefetchArea = area;
+    m_prefetchPresentation = presentation;
+    m_prefetchClock.start();
+
+    const int number = request->pageNumber();
+    if (presentation)
+        m_direction = 1;
+    else if (number != m_lastPage)
+        m_direction = number > m_lastPage ? 1 : -1;
+    m_lastPage = number;
+
+    // only pages with the same size can be prefetched at the same size
+    const Okular::Page *current = request->page();
+    QList<int> pages;
+    for (int i = 1; i <= m_prefetchPages; ++i) {
+        const int next = number + i * m_direction;
+        if (next < 0 || next >= int(document()->pages()))
+            break;
+        const Okular::Page *page = document()->page(next);
+        if (page->width() != current->width() || page->height() != current->height())
+            break;
+        pages.append(next);
+    }
+    m_prefetcher->prefetch(pages, QSize(request->width(), request->height()));
+    return true;
+}
+
+void MuPDFGenerator::runPixmapJob(PixmapJob *job)
+{
+    // create the text page for every visible page, as Okular does for
+    // threaded generators, so text tools work without delay; when the page
+    // is rendered too, both come from the same pass over its contents
+    if (job->image.isNull())
+        job->image = renderPixmap(job->request, &job->cookie,
+                                  job->calcTextPage ? &job->textPage : 0);
+    if (job->cookie.isAborted())
+        return;
+    // the image may come from a file rewritten while it was rendered
+    if (m_keepPages && !isTile(job->request))
+        job->unchanged = !m_pdfdoc.hasChangedOnDisk();
+    if (job->calcBoundingBox)
+        job->boundingBox = Okular::Utils::imageBoundingBox(&job->image);
+    if (job->calcTextPage && !job->textPage)
+        job->textPage = textPage(job->request->page());
+}
+
+void MuPDFGenerator::pixmapJobFinished()
+{
+    QFutureWatcher<void> *watcher = static_cast<QFutureWatcher<void>*>(sender());
+    PixmapJob *job = 0;
+    foreach (PixmapJob *j, m_pixmapJobs) {
+        if (j->watcher == watcher) {
+            job = j;
+            break;
+        }
+    }
+    if (!job)
+        return;
+    m_pixmapJobs.removeOne(job);
+
+    Okular::PixmapRequest *request = job->request;
+    Okular::Page *page = request->page();
+    // an aborted request is completed without a pixmap, so Okular asks
+    // again if the page is still needed
+    if (!job->cookie.isAborted()) {
+        setPagePixmap(request, job->image);
+        if (m_keepPages && !job->image.isNull() && job->unchanged) {
+            RenderedImage *rendered = new RenderedImage;
+            rendered->image = job->image;
+            m_rendered.insert(page->number(), rendered,
+                              job->image.byteCount() / 1024 + 1);
+            // the fingerprint is only needed at the next reload, so it is
+            // taken in the background rather than before the page is shown
+            if (!m_fingerprinted.contains(page->number())) {
+                m_fingerprinted.insert(page->number());
+                m_fingerprinting.addFuture(QtConcurrent::run(
+                    &m_pdfdoc, &QMuPDF::Document::pageFingerprint, page->number()));
+            }
+        }
+        if (job->calcBoundingBox)
+            updatePageBoundingBox(page->number(), job->boundingBox);
+    }
+    if (job->textPage && !page->hasTextPage()) {
+        page->setTextPage(job->textPage);
+        signalTextGenerationDone(page, job->textPage);
+    } else {
+        delete job->textPage;
+    }
+    // we are called by the watcher, so it cannot be deleted right away
+    watcher->deleteLater();
+    delete job;
+    m_prefetcher->resume();
+    if (m_textWatcher && m_pixmapJobs.isEmpty())
+        m_textWatcher->resume();
+    signalPixmapRequestDone(request);
+}
+
 QImage MuPDFGenerator::image(Okular::PixmapRequest *request)
 {
-    userMutex()->lock();
+    return renderPixmap(request, 0);
+}
+
+QImage MuPDFGenerator::renderPixmap(Okular::PixmapRequest *request,
+                                    QMuPDF::Cookie *cookie,
+                                    Okular::TextPage **textPage)
+{
+    QRect rect;
+#if OKULAR_IS_VERSION(0, 16, 0)
+    // tiles cover part of the page, scaled to the full request size
+    if (request->isTile())
+        rect = request->normalizedRect().geometry(request->width(),
+                                                  request->height());
+#endif
     QMuPDF::Page *page = m_pdfdoc.page(request->page()->number());
-    QImage image = page->render(request->width(), request->height());
-    userMutex()->unlock();
+    QImage image;
+    if (textPage) {
+        QMuPDF::TextLayout layout;
+        image = page->renderWithText(request->width(), request->height(), rect,
+                                     dpi(), &layout, cookie);
+        if (!image.isNull()) {
+            const QSizeF s = page->size(dpi());
+            *textPage = buildTextPage(layout, s.width(), s.height(), m_wordTextEntries);
+        }
+    } else {
+        image = page->render(request->width(), request->height(), rect, cookie);
+    }
     delete page;
     return image;
 }
@@ -351,6 +1156,7 @@ QImage MuPDFGenerator::image(Okular::PixmapRequest *request)
 void MuPDFGenerator::fillViewportFromSourceReference (Okular::DocumentViewport 
 & viewport, const QString & reference ) const
 {
+    waitForSynctexParser();
     if ( !synctex_scanner )
         return;
     
@@ -412,16 +1218,7 @@ void MuPDFGenerator::fillViewportFromSourceReference (Okular::DocumentViewport
 
 Okular::TextPage* MuPDFGenerator::textPage(Okular::Page *page)
 {
-    userMutex()->lock();
-    QMuPDF::Page *mp = m_pdfdoc.page(page->number());
-    const QVector<QMuPDF::TextBox *> boxes = mp->textBoxes(dpi());
-    const QSizeF s = mp->size(dpi());
-    userMutex()->unlock();
-    delete mp;
-
-    Okular::TextPage *tp = buildTextPage(boxes, s.width(), s.height());
-    qDeleteAll(boxes);
-    return tp;
+    return createTextPage(&m_pdfdoc, page->number(), dpi(), m_wordTextEntries);
 }
 
 QVariant MuPDFGenerator::metaData(const QString &key,
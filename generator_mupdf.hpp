@@ -16,10 +16,25 @@
 #include <okular/core/generator.h>
 #include <okular/core/sourcereference.h>
 #include <okular/core/version.h>
+#include <qcache.h>
+#include <qdatetime.h>
+#include <qelapsedtimer.h>
 #include <qfile.h>
+#include <qfuturesynchronizer.h>
+#include <qfuturewatcher.h>
+#include <qhash.h>
+#include <qlist.h>
+#include <qset.h>
+#include <qvector.h>
 
 #include "document.hpp"
 
+namespace QMuPDF {
+class Cookie;
+class Outline;
+class Prefetcher;
+}
+
 class MuPDFGenerator : public Okular::Generator {
     Q_OBJECT
 public:
@@ -29,12 +44,21 @@ public:
     Okular::Document::OpenResult loadDocumentWithPassword(
         const QString &fileName, QVector<Okular::Page *> &pages,
         const QString &password);
+    Okular::Document::OpenResult loadDocumentFromDataWithPassword(
+        const QByteArray &fileData, QVector<Okular::Page *> &pages,
+        const QString &password);
 #else
     bool loadDocument(const QString &fileName, QVector<Okular::Page*> &pages);
+    bool loadDocumentFromData(const QByteArray &fileData,
+                              QVector<Okular::Page*> &pages);
 #endif
     Okular::DocumentInfo generateDocumentInfo(const QSet<Okular::DocumentInfo::Key> &keys) const;
     const Okular::DocumentSynopsis *generateDocumentSynopsis();
     QVariant metaData(const QString &key, const QVariant &option) const;
+    Okular::ExportFormat::List exportFormats() const;
+    bool exportTo(const QString &fileName, const Okular::ExportFormat &format);
+    bool canGeneratePixmap() const;
+    void generatePixmap(Okular::PixmapRequest *request);
 protected:
     bool doCloseDocument();
     QImage image(Okular::PixmapRequest *page);
@@ -42,17 +66,84 @@ protected:
 protected slots:
     const Okular::SourceReference * dynamicSourceReference( int pageNr, double 
           absX, double absY );
+private slots:
+    void pixmapJobFinished();
+    void textPageReady(int index);
+    void textExtractionProgress(int value);
+    void textExtractionFinished();
+    void pageGeometryRead();
+    void pagesRestored();
     
 private:
+    struct PixmapJob;
+    struct RenderedImage {
+        QImage image;
+        QByteArray fingerprint;
+    };
+    void runPixmapJob(PixmapJob *job);
+    QImage renderPixmap(Okular::PixmapRequest *request, QMuPDF::Cookie *cookie,
+                        Okular::TextPage **textPage = 0);
+    bool schedulePrefetch(Okular::PixmapRequest *request);
+    void startTextExtraction();
+    void stopTextExtraction();
+    void stopReadingPageGeometry();
+#if OKULAR_IS_VERSION(0, 20, 0)
+    Okular::Document::OpenResult init(QVector<Okular::Page*> &pages,
+                                      const QString &password);
+#else
     bool init(QVector<Okular::Page*> &pages, const QString &walletKey);
+#endif
     void loadPages(QVector<Okular::Page*> &pages);
     void initSynctexParser( const QString& filePath );
+    void waitForSynctexParser() const;
+    void startRestoringPages(const QString &fileName);
+    QHash<int, int> restorePages(const QHash<int, QByteArray> &fingerprints, int pageCount);
+    void stopRestoringPages();
+    void startReadingOutline();
+    QMuPDF::Outline *takeOutline();
     void fillViewportFromSourceReference( Okular::DocumentViewport & viewport, 
          const QString & reference ) const;
     QMuPDF::Document m_pdfdoc;
     Okular::DocumentSynopsis *m_docSyn;
+    QList<PixmapJob*> m_pixmapJobs;
+    QMuPDF::Prefetcher *m_prefetcher;
+    int m_prefetchPages;
+    quintptr m_prefetchObserver;
+    qint64 m_prefetchArea;
+    bool m_prefetchPresentation;
+    QElapsedTimer m_prefetchClock;
+    int m_lastPage;
+    int m_direction;
+    // whether to keep what can be of the pages across a reload
+    bool m_keepPages;
+    // the last full page images given to Okular, keyed by page number; the
+    // cost is in kilobytes
+    QCache<int, RenderedImage> m_rendered;
+    // pages whose fingerprint is taken or being taken for m_rendered
+    QFutureSynchronizer<QByteArray> m_fingerprinting;
+    QSet<int> m_fingerprinted;
+    // the images of m_rendered kept by doCloseDocument() for the next load
+    // of m_keptFile, which had m_keptPageCount pages, until their new
+    // numbers are known
+    QHash<int, RenderedImage*> m_keptImages;
+    QString m_keptFile;
+    int m_keptPageCount;
+    QFutureWatcher<QHash<int, int> > *m_restoreWatcher;
+    bool m_extractText;
+    bool m_wordTextEntries;
+    bool m_progressiveLoading;
+    QVector<QMuPDF::PageGeometry> m_estimatedGeometry;
+    QFutureWatcher<QVector<QMuPDF::PageGeometry> > *m_geometryWatcher;
+    QMuPDF::Cookie *m_geometryCookie;
+    QVector<Okular::Page*> m_pages;
+    QFutureWatcher<Okular::TextPage*> *m_textWatcher;
+    QVector<bool> m_textDelivered;
+    QTime m_textTimer;
+    
+    QFuture<QMuPDF::Outline*> m_outlineFuture;
     
-    synctex_scanner_t synctex_scanner;
+    mutable synctex_scanner_t synctex_scanner;
+    mutable QFuture<synctex_scanner_t> m_synctexFuture;
 };
 
 #endif
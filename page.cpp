@@ -8,9 +8,13 @@
  ***************************************************************************/
 
 #include "page.hpp"
+#include "document_p.hpp"
+#include <QtCore/QMutexLocker>
 #include <QtGui/QImage>
+#include <cstring>
 extern "C" {
 #include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
 }
 
 namespace QMuPDF {
@@ -25,7 +29,7 @@ QImage convert_fz_pixmap(fz_context *ctx, fz_pixmap *image)
 {
     const int w = fz_pixmap_width(ctx, image);
     const int h = fz_pixmap_height(ctx, image);
-    QImage img(w, h, QImage::Format_ARGB32);
+    QImage img(w, h, QImage::Format_ARGB32_Premultiplied);
     unsigned char *data = fz_pixmap_samples(ctx, image);
     unsigned int *imgdata = (unsigned int *)img.bits();
     for (int i = 0; i < h; ++i) {
@@ -38,12 +42,230 @@ QImage convert_fz_pixmap(fz_context *ctx, fz_pixmap *image)
     return img;
 }
 
+TextLayout convert_fz_text_page(fz_context *ctx, fz_text_page *page,
+                                const QSizeF &dpi)
+{
+    int count = 0;
+    for (int i_block = 0; i_block < page->len; ++i_block) {
+        if (page->blocks[i_block].type != FZ_PAGE_BLOCK_TEXT)
+            continue;
+        fz_text_block &block = *page->blocks[i_block].u.text;
+        for (int i_line = 0; i_line < block.len; ++i_line) {
+            for (fz_text_span *s = block.lines[i_line].first_span; s; s = s->next)
+                count += s->len;
+        }
+    }
+
+    TextLayout layout;
+    layout.reserve(count);
+
+    for (int i_block = 0; i_block < page->len; ++i_block) {
+        if (page->blocks[i_block].type != FZ_PAGE_BLOCK_TEXT)
+            continue;
+        fz_text_block &block = *page->blocks[i_block].u.text;
+        for (int i_line = 0; i_line < block.len; ++i_line) {
+            fz_text_line &line = block.lines[i_line];
+            bool hasText = false;
+            for (fz_text_span *s = line.first_span; s; s = s->next) {
+                fz_text_span &span = *s;
+                for (int i_char = 0; i_char < span.len; ++i_char) {
+                    fz_rect bbox; fz_text_char_bbox(ctx, &bbox, s, i_char);
+                    layout.append(span.text[i_char].c, convert_fz_rect(bbox, dpi));
+                    if (i_char == 0)
+                        layout.markAtStartOfSpan();
+                    hasText = true;
+                }
+            }
+            if (hasText)
+                layout.markAtEndOfLine();
+        }
+    }
+
+    return layout;
+}
+
+TextLayout TextLayout::scaled(qreal sx, qreal sy) const
+{
+    TextLayout layout(*this);
+    QRectF *rects = layout.m_rects.data();
+    for (int i = 0; i < layout.m_rects.count(); ++i) {
+        const QRectF &r = rects[i];
+        rects[i] = QRectF(QPointF(r.left() * sx, r.top() * sy),
+                          QPointF(r.right() * sx, r.bottom() * sy));
+    }
+    return layout;
+}
+
+// in bytes, roughly
+int TextLayout::memoryUsage() const
+{
+    return sizeof(TextLayout) + m_chars.count()
+        * (sizeof(uint) + sizeof(QRectF) + sizeof(uchar));
+}
+
+Cookie::Cookie()
+    : m_cookie(new fz_cookie)
+{
+    std::memset(m_cookie, 0, sizeof(fz_cookie));
+}
+
+Cookie::~Cookie()
+{
+    delete m_cookie;
+}
+
+void Cookie::abort()
+{
+    // MuPDF polls this flag, which may be set from any thread
+    m_cookie->abort = 1;
+}
+
+bool Cookie::isAborted() const
+{
+    return m_cookie->abort;
+}
+
 struct Page::Data {
     Data(): pageNum(-1), doc(0), page(0) { }
     int pageNum;
-    fz_context *ctx;
-    fz_document *doc;
+    Document::Data *doc;
     fz_page *page;
+
+    fz_display_list *record(fz_context *ctx, fz_cookie *cookie, int *cost) const
+    {
+        // interpreting the page needs the document, replaying the list
+        // does not: only this part is serialized
+        QMutexLocker locker(&doc->mutex);
+        fz_display_list *list = fz_new_display_list(ctx);
+        fz_device *device = fz_new_list_device(ctx, list);
+        fz_run_page(ctx, page, device, &fz_identity, cookie);
+        fz_drop_device(ctx, device);
+        if (cost)
+            *cost = doc->contentsSize(ctx, pageNum) / 1024 + 1;
+        return list;
+    }
+    fz_display_list *displayList(fz_context *ctx, fz_cookie *cookie) const
+    {
+        QMutexLocker locker(&doc->listsMutex);
+        if (DisplayList *cached = doc->lists.object(pageNum))
+            return fz_keep_display_list(ctx, cached->list);
+        const bool cache = doc->lists.maxCost() > 0;
+        locker.unlock();
+
+        int cost = 0;
+        fz_display_list *list = record(ctx, cookie, cache ? &cost : 0);
+        // what was read from a file rewritten meanwhile is not worth keeping
+        if (cache && !cookie->errors && !cookie->abort && !doc->fileChanged()) {
+            locker.relock();
+            DisplayList *entry = new DisplayList(&doc->context,
+                                                 fz_keep_display_list(ctx, list));
+            doc->lists.insert(pageNum, entry, cost);
+        }
+        return list;
+    }
+    QImage draw(fz_context *ctx, fz_display_list *list, qreal width, qreal height,
+                const QRect &rect, fz_cookie *cookie) const
+    {
+        fz_rect bounds;
+        QMutexLocker locker(&doc->mutex);
+        fz_bound_page(doc->ctx, page, &bounds);
+        locker.unlock();
+        fz_matrix ctm;
+        fz_scale(&ctm, width / (bounds.x1 - bounds.x0), height / (bounds.y1 - bounds.y0));
+
+        fz_irect bbox;
+        if (rect.isValid()) {
+            bbox.x0 = rect.left();
+            bbox.y0 = rect.top();
+            bbox.x1 = rect.left() + rect.width();
+            bbox.y1 = rect.top() + rect.height();
+        } else {
+            bbox.x0 = bbox.y0 = 0;
+            bbox.x1 = width;
+            bbox.y1 = height;
+        }
+        fz_rect area;
+        fz_rect_from_irect(&area, &bbox);
+
+        QImage img;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        // in memory, BGRA samples are the ARGB32 pixels of QImage: let MuPDF
+        // draw straight into the image
+        img = QImage(bbox.x1 - bbox.x0, bbox.y1 - bbox.y0,
+                     QImage::Format_ARGB32_Premultiplied);
+        if (img.isNull())
+            return img;
+        fz_pixmap *image = fz_new_pixmap_with_bbox_and_data(ctx, fz_device_bgr(ctx),
+                                                            &bbox, img.bits());
+#else
+        fz_pixmap *image = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), &bbox);
+#endif
+        fz_clear_pixmap_with_value(ctx, image, 0xff);
+        fz_device *device = fz_new_draw_device_with_bbox(ctx, image, &bbox);
+        fz_run_display_list(ctx, list, device, &ctm, &area, cookie);
+        fz_drop_device(ctx, device);
+
+        if (cookie->errors || cookie->abort)
+            img = QImage();
+#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
+        else
+            img = convert_fz_pixmap(ctx, image);
+#endif
+        fz_drop_pixmap(ctx, image);
+        return img;
+    }
+    bool cachedText(TextLayout *layout) const
+    {
+        QMutexLocker locker(&doc->textsMutex);
+        TextLayout *cached = doc->texts.object(pageNum);
+        if (!cached)
+            return false;
+        ++doc->textStats.hits;
+        *layout = *cached;
+        return true;
+    }
+    // runs list through a text device
+    TextLayout extractText(fz_context *ctx, fz_display_list *list, bool *ok) const
+    {
+        fz_cookie cookie = { 0, 0, 0, 0, 0, 0 };
+        fz_text_page *textPage = fz_new_text_page(ctx);
+        fz_text_sheet *sheet = fz_new_text_sheet(ctx);
+        fz_device *device = fz_new_text_device(ctx, sheet, textPage);
+        fz_run_display_list(ctx, list, device, &fz_identity, &fz_infinite_rect, &cookie);
+        fz_drop_device(ctx, device);
+
+        TextLayout layout;
+        *ok = !cookie.errors;
+        if (*ok)
+            layout = convert_fz_text_page(ctx, textPage, QSizeF(72, 72));
+        fz_drop_text_page(ctx, textPage);
+        fz_drop_text_sheet(ctx, sheet);
+        return layout;
+    }
+    // The text of the page at 72 dpi, from the document's text cache or
+    // extracted from list, which is recorded if 0.
+    TextLayout text(fz_context *ctx, fz_display_list *list) const
+    {
+        TextLayout layout;
+        if (cachedText(&layout))
+            return layout;
+        QMutexLocker locker(&doc->textsMutex);
+        ++doc->textStats.misses;
+        locker.unlock();
+
+        fz_cookie cookie = { 0, 0, 0, 0, 0, 0 };
+        list = list ? fz_keep_display_list(ctx, list) : displayList(ctx, &cookie);
+        bool ok;
+        layout = extractText(ctx, list, &ok);
+        fz_drop_display_list(ctx, list);
+        ok = ok && !cookie.errors;
+
+        locker.relock();
+        if (ok && doc->texts.maxCost() > 0 && !doc->fileChanged())
+            doc->texts.insert(pageNum, new TextLayout(layout),
+                              layout.memoryUsage() / 1024 + 1);
+        return layout;
+    }
 };
 
 Page::Page()
@@ -53,20 +275,32 @@ Page::Page()
 
 Page::~Page()
 {
-    fz_drop_page(d->ctx, d->page);
+    QMutexLocker locker(&d->doc->mutex);
+    fz_drop_page(d->doc->ctx, d->page);
+    locker.unlock();
     delete d;
 }
 
-Page *Page::make(fz_context_s *ctx, fz_document_s *doc, int num)
+Page *Page::make(const Document *document, int num)
 {
-    Q_ASSERT(doc && ctx);
-    fz_page *page = fz_load_page(ctx, doc, num);
-    if (!page)
-        return 0;
+    Q_ASSERT(document);
+    Document::Data *doc = document->d;
+    QMutexLocker locker(&doc->mutex);
+    fz_page *page;
+    if (LoadedPage *loaded = doc->pages.object(num)) {
+        ++doc->pageStats.hits;
+        page = fz_keep_page(doc->ctx, loaded->page);
+    } else {
+        ++doc->pageStats.misses;
+        page = fz_load_page(doc->ctx, doc->mdoc, num);
+        if (!page)
+            return 0;
+        doc->pages.insert(num, new LoadedPage(doc->ctx,
+                                              fz_keep_page(doc->ctx, page)));
+    }
     Page *p = new Page();
     p->d->pageNum = num;
     p->d->doc = doc;
-    p->d->ctx = ctx;
     p->d->page = page;
     return p;
 }
@@ -80,7 +314,8 @@ int Page::number() const
 QSizeF Page::size(const QSizeF &dpi) const
 {
     fz_rect rect;
-    fz_bound_page(d->ctx, d->page, &rect);
+    QMutexLocker locker(&d->doc->mutex);
+    fz_bound_page(d->doc->ctx, d->page, &rect);
     // MuPDF always assumes 72dpi
     return QSizeF((rect.x1 - rect.x0)*dpi.width()/72.,
                   (rect.y1 - rect.y0)*dpi.height()/72.);
@@ -89,74 +324,57 @@ QSizeF Page::size(const QSizeF &dpi) const
 qreal Page::duration() const
 {
     float val;
-    (void)fz_page_presentation(d->ctx, d->page, &val);
+    QMutexLocker locker(&d->doc->mutex);
+    (void)fz_page_presentation(d->doc->ctx, d->page, &val);
     return val < 0.1 ? -1 : val;
 }
 
-QImage Page::render(qreal width, qreal height) const
+// Renders the page scaled to width x height; if rect is valid, only that
+// part of the scaled page is rendered, and the image has the size of rect.
+// A null image is returned if rendering failed or was aborted.
+QImage Page::render(qreal width, qreal height, const QRect &rect,
+                    Cookie *cookie) const
 {
-    const QSizeF s = size(QSizeF(72, 72));
-
-    fz_matrix ctm;
-    fz_scale(&ctm, width / s.width(), height / s.height());
-
-    fz_cookie cookie = { 0, 0, 0, 0, 0, 0 };
-    fz_colorspace *csp = fz_device_rgb(d->ctx);
-    fz_pixmap *image = fz_new_pixmap(d->ctx, csp, width, height);
-    fz_clear_pixmap_with_value(d->ctx, image, 0xff);
-    fz_device *device = fz_new_draw_device(d->ctx, image);
-    fz_run_page(d->ctx, d->page, device, &ctm, &cookie);
-    fz_drop_device(d->ctx, device);
-
+    ScopedContext ctx(&d->doc->context);
+    fz_cookie local = { 0, 0, 0, 0, 0, 0 };
+    fz_cookie *c = cookie ? cookie->m_cookie : &local;
+    fz_display_list *list = d->displayList(ctx, c);
     QImage img;
-    if (!cookie.errors)
-        img = convert_fz_pixmap(d->ctx, image);
-    fz_drop_pixmap(d->ctx, image);
+    if (!c->abort)
+        img = d->draw(ctx, list, width, height, rect, c);
+    fz_drop_display_list(ctx, list);
     return img;
 }
 
-QVector<TextBox *> Page::textBoxes(const QSizeF &dpi) const
+// Same as render(), also returning the text of the page at the given dpi
+// in text, unless rendering failed. The contents are interpreted once for
+// both when the text is not cached yet.
+QImage Page::renderWithText(qreal width, qreal height, const QRect &rect,
+                            const QSizeF &dpi, TextLayout *text,
+                            Cookie *cookie) const
 {
-    fz_cookie cookie = { 0, 0, 0, 0, 0, 0 };
-    fz_text_page *page = fz_new_text_page(d->ctx);
-    fz_text_sheet *sheet = fz_new_text_sheet(d->ctx);
-    fz_device *device = fz_new_text_device(d->ctx, sheet, page);
-    fz_run_page(d->ctx, d->page, device, &fz_identity, &cookie);
-    fz_drop_device(d->ctx, device);
-    if (cookie.errors) {
-        fz_drop_text_page(d->ctx, page);
-        fz_drop_text_sheet(d->ctx, sheet);
-        return QVector<TextBox *>();
-    }
-
-    QVector<TextBox *> boxes;
-
-    for (int i_block = 0; i_block < page->len; ++i_block) {
-        if (page->blocks[i_block].type != FZ_PAGE_BLOCK_TEXT)
-            continue;
-        fz_text_block &block = *page->blocks[i_block].u.text;
-        for (int i_line = 0; i_line < block.len; ++i_line) {
-            fz_text_line &line = block.lines[i_line];
-            bool hasText = false;
-            for (fz_text_span *s = line.first_span; s; s = s->next) {
-                fz_text_span &span = *s;
-                for (int i_char = 0; i_char < span.len; ++i_char) {
-                    fz_rect bbox; fz_text_char_bbox(d->ctx, &bbox, s, i_char);
-                    const int text = span.text[i_char].c;
-                    TextBox *box = new TextBox(text, convert_fz_rect(bbox, dpi));
-                    boxes.append(box);
-                    hasText = true;
-                }
-            }
-            if (hasText)
-                boxes.back()->markAtEndOfLine();
-        }
-    }
+    ScopedContext ctx(&d->doc->context);
+    fz_cookie local = { 0, 0, 0, 0, 0, 0 };
+    fz_cookie *c = cookie ? cookie->m_cookie : &local;
+    fz_display_list *list = d->displayList(ctx, c);
+    QImage img;
+    if (!c->abort)
+        img = d->draw(ctx, list, width, height, rect, c);
+    if (!img.isNull())
+        *text = d->text(ctx, list).scaled(dpi.width() / 72., dpi.height() / 72.);
+    fz_drop_display_list(ctx, list);
+    return img;
+}
 
-    fz_drop_text_page(d->ctx, page);
-    fz_drop_text_sheet(d->ctx, sheet);
+// Text is extracted at 72 dpi and kept in the document's text cache, so
+// asking again for the same page (search, selection, speech) does not run
+// its contents through a text device again.
+TextLayout Page::textLayout(const QSizeF &dpi) const
+{
+    ScopedContext ctx(&d->doc->context);
+    return d->text(ctx, 0).scaled(dpi.width() / 72., dpi.height() / 72.);
+}
 
-    return boxes;
 }
 
 }
@@ -12,13 +12,27 @@
 
 #include <QtCore/QString>
 #include <QtCore/QRect>
+#include <QtCore/QVector>
 
 class QImage;                           class QSizeF;
-struct fz_document_s;                   struct fz_context_s;
+struct fz_cookie_s;
 
 namespace QMuPDF {
 
-class TextBox;
+class Document;                         class TextLayout;
+
+// Lets another thread stop a render() in progress.
+class Cookie {
+public:
+    Cookie();
+    ~Cookie();
+    void abort();
+    bool isAborted() const;
+private:
+    Q_DISABLE_COPY(Cookie)
+    friend class Page;
+    fz_cookie_s *m_cookie;
+};
 
 class Page {
 public:
@@ -26,9 +40,13 @@ public:
     int number() const;
     QSizeF size(const QSizeF &dpi) const;
     qreal duration() const;
-    QImage render(qreal width, qreal height) const;
-    QVector<TextBox *> textBoxes(const QSizeF &dpi) const;
-    static Page *make(fz_context_s *ctx, fz_document_s *doc, int num);
+    QImage render(qreal width, qreal height, const QRect &rect = QRect(),
+                  Cookie *cookie = 0) const;
+    QImage renderWithText(qreal width, qreal height, const QRect &rect,
+                          const QSizeF &dpi, TextLayout *text,
+                          Cookie *cookie = 0) const;
+    TextLayout textLayout(const QSizeF &dpi) const;
+    static Page *make(const Document *doc, int num);
 private:
     Page();
     Q_DISABLE_COPY(Page)
@@ -36,18 +54,41 @@ private:
     Data *d;
 };
 
-class TextBox {
+// The characters of a page, in reading order, stored as one array per
+// attribute rather than one object per character.
+class TextLayout {
 public:
-    TextBox(QChar c, const QRectF &bbox)
-        : m_text(c), m_rect(bbox), m_end(false) { }
-    QRectF rect() const { return m_rect; }
-    QChar text() const { return m_text; }
-    bool isAtEndOfLine() const { return m_end; }
-    void markAtEndOfLine() { m_end = true; }
+    int count() const { return m_chars.count(); }
+    bool isEmpty() const { return m_chars.isEmpty(); }
+    uint charAt(int i) const { return m_chars.at(i); }
+    QVector<uint> chars() const { return m_chars; }
+    QRectF rect(int i) const { return m_rects.at(i); }
+    bool isAtEndOfLine(int i) const { return m_flags.at(i) & EndOfLine; }
+    bool isAtStartOfSpan(int i) const { return m_flags.at(i) & StartOfSpan; }
+    void reserve(int size)
+    {
+        m_chars.reserve(size);
+        m_rects.reserve(size);
+        m_flags.reserve(size);
+    }
+    void append(uint c, const QRectF &bbox)
+    {
+        m_chars.append(c);
+        m_rects.append(bbox);
+        m_flags.append(0);
+    }
+    void markAtEndOfLine() { m_flags.last() |= EndOfLine; }
+    void markAtStartOfSpan() { m_flags.last() |= StartOfSpan; }
+    TextLayout scaled(qreal sx, qreal sy) const;
+    int memoryUsage() const;
 private:
-    QChar m_text;
-    QRectF m_rect;
-    bool m_end : 1;
+    enum Flag {
+        EndOfLine = 0x1,
+        StartOfSpan = 0x2
+    };
+    QVector<uint> m_chars;
+    QVector<QRectF> m_rects;
+    QVector<uchar> m_flags;
 };
 
 }
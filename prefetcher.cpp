@@ -0,0 +1,141 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "prefetcher.hpp"
+#include "page.hpp"
+#include <QtCore/QMutexLocker>
+
+namespace QMuPDF {
+
+Prefetcher::Prefetcher(const Document *doc)
+    : m_doc(doc), m_cookie(0), m_yielding(0), m_quit(false)
+{
+    // a handful of full pages
+    m_images.setMaxCost(64 * 1024);
+}
+
+Prefetcher::~Prefetcher()
+{
+    m_mutex.lock();
+    m_quit = true;
+    if (m_cookie)
+        m_cookie->abort();
+    m_wakeUp.wakeAll();
+    m_mutex.unlock();
+    wait();
+}
+
+// Replaces the pages to prefetch; images already rendered at another size
+// are useless from now on.
+void Prefetcher::prefetch(const QList<int> &pages, const QSize &size)
+{
+    QMutexLocker locker(&m_mutex);
+    if (size != m_size) {
+        m_images.clear();
+        m_size = size;
+    }
+    m_queue = pages;
+    m_wakeUp.wakeAll();
+}
+
+// Returns the prefetched image of a page, if it has the requested size.
+// Only the requests of the view pages are prefetched for should come here,
+// so that the hits and misses tell how well prefetching guesses.
+QImage Prefetcher::take(int page, const QSize &size)
+{
+    QMutexLocker locker(&m_mutex);
+    QImage image;
+    if (size == m_size) {
+        if (QImage *cached = m_images.take(page)) {
+            image = *cached;
+            delete cached;
+        }
+    }
+    if (image.isNull())
+        ++m_stats.misses;
+    else
+        ++m_stats.hits;
+    return image;
+}
+
+// Real requests go first: stop what is being prefetched, and do not start
+// anything else until resume() is called as many times as yield().
+void Prefetcher::yield()
+{
+    QMutexLocker locker(&m_mutex);
+    ++m_yielding;
+    if (m_cookie)
+        m_cookie->abort();
+}
+
+void Prefetcher::resume()
+{
+    QMutexLocker locker(&m_mutex);
+    if (--m_yielding == 0)
+        m_wakeUp.wakeAll();
+}
+
+// Forgets everything, and waits for the page being rendered, if any, so
+// the document can be closed.
+void Prefetcher::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue.clear();
+    if (m_cookie)
+        m_cookie->abort();
+    while (m_cookie)
+        m_idle.wait(&m_mutex);
+    m_images.clear();
+    m_size = QSize();
+}
+
+CacheStats Prefetcher::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_stats;
+}
+
+void Prefetcher::run()
+{
+    QMutexLocker locker(&m_mutex);
+    forever {
+        while (!m_quit && (m_yielding > 0 || m_queue.isEmpty()))
+            m_wakeUp.wait(&m_mutex);
+        if (m_quit)
+            return;
+
+        const int number = m_queue.first();
+        const QSize size = m_size;
+        if (m_images.contains(number)) {
+            m_queue.removeFirst();
+            continue;
+        }
+
+        Cookie cookie;
+        m_cookie = &cookie;
+        locker.unlock();
+        QImage image;
+        if (Page *page = m_doc->page(number)) {
+            image = page->render(size.width(), size.height(), QRect(), &cookie);
+            delete page;
+        }
+        locker.relock();
+        m_cookie = 0;
+        m_idle.wakeAll();
+
+        // if aborted, the page stays queued for when we can go on
+        if (cookie.isAborted())
+            continue;
+        m_queue.removeOne(number);
+        if (!image.isNull() && size == m_size)
+            m_images.insert(number, new QImage(image), image.byteCount() / 1024 + 1);
+    }
+}
+
+}
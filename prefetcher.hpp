@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_PREFETCHER_HPP
+#define QMUPDF_PREFETCHER_HPP
+
+#include "document.hpp"
+#include <QtCore/QCache>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QSize>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
+#include <QtGui/QImage>
+
+namespace QMuPDF {
+
+class Cookie;
+
+// Renders pages that are likely to be asked for next on an idle priority
+// thread, and keeps the images until they are taken. Loading a page and
+// recording it also warm the page and display list caches, and MuPDF's
+// store keeps the images decoded while rendering.
+class Prefetcher : public QThread {
+public:
+    Prefetcher(const Document *doc);
+    ~Prefetcher();
+    void prefetch(const QList<int> &pages, const QSize &size);
+    QImage take(int page, const QSize &size);
+    void yield();
+    void resume();
+    void clear();
+    CacheStats stats() const;
+protected:
+    void run();
+private:
+    Q_DISABLE_COPY(Prefetcher)
+    const Document *m_doc;
+    mutable QMutex m_mutex;
+    QWaitCondition m_wakeUp;
+    QWaitCondition m_idle;
+    QList<int> m_queue;
+    QSize m_size;
+    // page number -> image at m_size, the cost is in kilobytes
+    QCache<int, QImage> m_images;
+    Cookie *m_cookie;
+    int m_yielding;
+    bool m_quit;
+    CacheStats m_stats;
+};
+
+}
+
+#endif
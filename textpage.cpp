@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "textpage.hpp"
+#include "page.hpp"
+#include <okular/core/area.h>
+#include <okular/core/textpage.h>
+
+static void appendTextEntity(Okular::TextPage *ktp, const QString &text,
+                             const QRectF &bbox, qreal width, qreal height)
+{
+    ktp->append(text, new Okular::NormalizedRect(
+                    bbox.left() / width, bbox.top() / height,
+                    bbox.right() / width, bbox.bottom() / height));
+}
+
+static QString charText(uint c)
+{
+    return c > 0xffff ? QString::fromUcs4(&c, 1) : QString(QChar(c));
+}
+
+// A word ends after whitespace, at the end of a line, or where MuPDF starts
+// a new span (a change of font or direction). The whitespace stays with the
+// word before.
+Okular::TextPage *buildTextPage(const QMuPDF::TextLayout &layout,
+                               qreal width, qreal height, bool words)
+{
+    Okular::TextPage *ktp = new Okular::TextPage();
+    if (!words) {
+        for (int i = 0; i < layout.count(); ++i) {
+            QString text = charText(layout.charAt(i));
+            if (layout.isAtEndOfLine(i))
+                text += QLatin1Char('\n');
+            appendTextEntity(ktp, text, layout.rect(i), width, height);
+        }
+        return ktp;
+    }
+
+    QString word;
+    QRectF wordBBox;
+    for (int i = 0; i < layout.count(); ++i) {
+        if (layout.isAtStartOfSpan(i) && !word.isEmpty()) {
+            appendTextEntity(ktp, word, wordBBox, width, height);
+            word.clear();
+            wordBBox = QRectF();
+        }
+        const uint c = layout.charAt(i);
+        word += charText(c);
+        wordBBox |= layout.rect(i);
+        const bool endOfLine = layout.isAtEndOfLine(i);
+        if (endOfLine || (c <= 0xffff && QChar(c).isSpace())) {
+            if (endOfLine)
+                word += QLatin1Char('\n');
+            appendTextEntity(ktp, word, wordBBox, width, height);
+            word.clear();
+            wordBBox = QRectF();
+        }
+    }
+    if (!word.isEmpty())
+        appendTextEntity(ktp, word, wordBBox, width, height);
+    return ktp;
+}
@@ -0,0 +1,30 @@
+/***************************************************************************
+ *   Copyright (C) 2008 by Pino Toscano <pino@kde.org>                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_TEXTPAGE_HPP
+#define QMUPDF_TEXTPAGE_HPP
+
+#include <QtCore/QtGlobal>
+
+namespace Okular {
+class TextPage;
+}
+
+namespace QMuPDF {
+class TextLayout;
+}
+
+// Converts the text of a page, as extracted at the size width x height,
+// to what Okular uses for search and selection: one entry per character,
+// or, if words is true, per word, which takes several times less memory
+// but makes selection and search highlights snap to whole words.
+Okular::TextPage *buildTextPage(const QMuPDF::TextLayout &layout,
+                                qreal width, qreal height, bool words = false);
+
+#endif